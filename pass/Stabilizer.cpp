@@ -1,14 +1,18 @@
 #include <llvm/Pass.h>
+#include <llvm/Analysis/CFG.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
 
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/InlineAsm.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
 
 #include <map>
 #include <set>
@@ -29,12 +33,21 @@ cl::opt<bool> stabilize_heap   ("stabilize-heap",    cl::init(false), cl::desc("
 cl::opt<bool> stabilize_stack  ("stabilize-stack",   cl::init(false), cl::desc("Randomize stack frame placement"));
 cl::opt<bool> stabilize_code   ("stabilize-code",    cl::init(false), cl::desc("Randomize function placement"));
 
+// Code randomization options
+cl::opt<bool> direct_calls     ("stabilize-direct-calls", cl::init(false), cl::desc("Keep direct calls and let the runtime patch their displacements"));
+cl::opt<bool> safepoints       ("stabilize-safepoints", cl::init(false), cl::desc("Poll for pending epochs at function entries and loop back-edges"));
+
 struct StabilizerImpl {
     static char ID;
 
-    Function* registerFunction;
+    Function* registerFunctions;
     Function* registerConstructor;
     Function* registerStackPad;
+    Function* useDirectCalls;
+    Function* useSafepoints;
+    Function* useHeap;
+    Function* safepoint;
+    GlobalVariable* epochPending;
 
     StabilizerImpl() {}
 
@@ -149,8 +162,8 @@ struct StabilizerImpl {
 
         map<Function*, GlobalVariable*> stackPads;
 
-        // Declare the stack pad table type
-        Type* stackPadType = Type::getInt8Ty(m.getContext());
+        // Each function's stack pad is an intptr holding the pad size in bytes
+        Type* stackPadType = getIntptrType(m);
 
         // Enable stack randomization
         if(stabilize_stack) {
@@ -162,7 +175,7 @@ struct StabilizerImpl {
                     stackPadType,
                     false,
                     GlobalValue::InternalLinkage,
-                    getInt(m, 8, 0, false),
+                    getIntptr(m, 0, false),
                     f->getName()+".stack_pad"
                 );
 
@@ -181,21 +194,66 @@ struct StabilizerImpl {
 
         // Enable code randomization
         if(stabilize_code) {
-            // Transform each function and register it with the stabilizer runtime
+            // Insert polls first, so the reference to the flag goes through the relocation table
+            if(safepoints) {
+                for(Function* f : local_functions) {
+                    insertSafepoints(m, *f);
+                }
+            }
+
+            // Transform each function and add it to the module's function table
+            vector<Constant*> records;
             for(Function* f : local_functions) {
-                vector<Value*> args = randomizeCode(m, *f);
+                vector<Constant*> fields = randomizeCode(m, *f);
 
-                Value* table = stackPads[f];
+                Constant* table = stackPads[f];
                 if(table == NULL) {
                     table = Constant::getNullValue(PointerType::get(stackPadType, 0));
                 }
 
-                args.push_back(table);
+                fields.push_back(table);
+
+                records.push_back(makeFunctionRecord(m, fields));
+            }
+
+            // Register the whole table with the stabilizer runtime in one call
+            if(records.size() > 0) {
+                ArrayType* tableType = ArrayType::get(records[0]->getType(), records.size());
+
+                GlobalVariable* functionTable = new GlobalVariable(
+                    m,
+                    tableType,
+                    true,
+                    GlobalValue::InternalLinkage,
+                    ConstantArray::get(tableType, records),
+                    "stabilizer.functions"
+                );
+
+                functionTable->setSection("stabilizer_functions");
+
+                vector<Value*> args;
+                args.push_back(ConstantExpr::getPointerCast(functionTable, Type::getInt8PtrTy(m.getContext())));
+                args.push_back(getIntptr(m, records.size(), false));
+
+                CallInst::Create(registerFunctions, args, "", ctor_bb);
+            }
+
+            // Tell the runtime it has to patch call sites when copying code
+            if(direct_calls) {
+                CallInst::Create(useDirectCalls, "", ctor_bb);
+            }
 
-                CallInst::Create(registerFunction, args, "", ctor_bb);
+            // Tell the runtime to wait for a safepoint instead of interrupting the program
+            if(safepoints) {
+                CallInst::Create(useSafepoints, "", ctor_bb);
             }
         }
 
+        // Tell the runtime to move the global operator new and delete onto the randomized heap
+        if(stabilize_heap) {
+            CallInst::Create(useHeap, "", ctor_bb);
+        }
+
         // Register each existing constructor with the stabilizer runtime
         for(Value* ctor_iter : old_ctors) {
             vector<Value*> args;
@@ -207,7 +265,7 @@ struct StabilizerImpl {
         if(stabilize_stack && !stabilize_code) {
             for(auto [func, pad] : stackPads) {
                 vector<Value*> args;
-                args.push_back(pad);
+                args.push_back(ConstantExpr::getPointerCast(pad, Type::getInt8PtrTy(m.getContext())));
                 CallInst::Create(registerStackPad, args, "", ctor_bb);
             }
         }
@@ -360,17 +418,8 @@ struct StabilizerImpl {
         for(CallInst* c : calls) {
             Instruction* next = c->getNextNode();
 
-            // Load the stack pad size and widen it to an intptr
-            Value* pad = new LoadInst(Type::getInt8Ty(m.getContext()), stackPad, "pad", c);
-            Value* wide_pad = ZExtInst::CreateZExtOrBitCast(pad, getIntptrType(m), "", c);
-
-            // Multiply the pad by the required stack alignment
-            BinaryOperator* padSize = BinaryOperator::CreateNUWMul(
-                wide_pad,
-                getIntptr(m, 16, false),
-                "aligned_pad",
-                c
-            );
+            // Load the stack pad size.  The runtime keeps it a multiple of the stack alignment.
+            Value* padSize = new LoadInst(getIntptrType(m), stackPad, "pad", c);
 
             CallInst* oldStack = CallInst::Create(stacksave, "", c);
             PtrToIntInst* oldStackInt = new PtrToIntInst(oldStack, getIntptrType(m), "", c);
@@ -388,14 +437,55 @@ struct StabilizerImpl {
         }
     }
 
+    /**
+     * \brief Poll for a pending epoch at the function entry and on every loop back-edge
+     * Each poll is a load and a branch on a flag the runtime's timer sets; the
+     * rarely-taken side calls into the runtime, which relocates functions while
+     * this thread sits at a known point in its code.
+     *
+     * \arg m The module being transformed
+     * \arg f The function being transformed
+     */
+    void insertSafepoints(Module& m, Function& f) {
+        vector<Instruction*> polls;
+
+        // Poll after the entry block's allocas so they stay static
+        BasicBlock::iterator entry = f.getEntryBlock().getFirstInsertionPt();
+        while(isa<AllocaInst>(&*entry)) {
+            entry++;
+        }
+        polls.push_back(&*entry);
+
+        // Poll before the branch at the source of each back-edge
+        SmallVector<pair<const BasicBlock*, const BasicBlock*>, 8> backedges;
+        FindFunctionBackedges(f, backedges);
+
+        set<const BasicBlock*> sources;
+        for(auto [from, to] : backedges) {
+            if(sources.insert(from).second) {
+                polls.push_back(const_cast<BasicBlock*>(from)->getTerminator());
+            }
+        }
+
+        MDNode* unlikely = MDBuilder(m.getContext()).createBranchWeights(1, 1 << 20);
+
+        for(Instruction* i : polls) {
+            LoadInst* pending = new LoadInst(Type::getInt32Ty(m.getContext()), epochPending, "epoch_pending", true, i);
+            Value* isPending = new ICmpInst(i, ICmpInst::ICMP_NE, pending, getInt(m, 32, 0, false));
+
+            Instruction* then = SplitBlockAndInsertIfThen(isPending, i, false, unlikely);
+            CallInst::Create(safepoint, "", then);
+        }
+    }
+
     /**
      * \brief Transform a function to reference globals only through a relocation table.
      *
      * \arg m The module being transformed
      * \arg f The function being transformed
-     * \returns The arguments to be passed to stabilizer_register_function
+     * \returns The fields of the function's record in the module's function table
      */
-    vector<Value*> randomizeCode(Module& m, Function& f) {
+    vector<Constant*> randomizeCode(Module& m, Function& f) {
         // Add a dummy function used to compute the size
         Function* next = Function::Create(
             FunctionType::get(Type::getVoidTy(m.getContext()), false),
@@ -413,6 +503,15 @@ struct StabilizerImpl {
         // Ensure the dummy is placed immediately after our function
         m.getFunctionList().insertAfter(f.getIterator(), next);
 
+        // The linker only keeps the order within a section, so with a section per function the dummy shares ours
+        if(f.hasSection()) {
+            next->setSection(f.getSection());
+        } else if(direct_calls) {
+            string section = (".text.stabilizer." + f.getName()).str();
+            f.setSection(section);
+            next->setSection(section);
+        }
+
         // Remove stack protection (creates implicit global references)
         f.removeFnAttr(Attribute::StackProtect);
         f.removeFnAttr(Attribute::StackProtectReq);
@@ -431,11 +530,25 @@ struct StabilizerImpl {
         // Collect all the referenced global values in this function
         map<Constant*, set<Use*> > references = findPCRelativeUsesIn(f);
 
-        if(references.size() > 0) {
-            // Build an ordered list of referenced constants
+        // Direct calls get their own slots, so the runtime can point them at callees' current copies
+        map<Constant*, set<Use*> > calls = extractCallTargets(references);
+
+        // Or leave them as PC-relative calls, which the runtime patches in each copy
+        if(direct_calls) {
+            calls.clear();
+        }
+
+        if(calls.size() + references.size() > 0) {
+            // Build an ordered list of referenced constants, with call targets first
             vector<Constant*> referencedValues;
+            vector<set<Use*>*> referencedUses;
+            for(auto& p : calls) {
+                referencedValues.push_back(p.first);
+                referencedUses.push_back(&p.second);
+            }
             for(auto& p : references) {
                 referencedValues.push_back(p.first);
+                referencedUses.push_back(&p.second);
             }
 
             // Create an ordered list of types for the referenced constants
@@ -468,12 +581,15 @@ struct StabilizerImpl {
             if(isDataPCRelative(m)) {
                 Type* ptr = PointerType::get(relocationTableType, 0);
                 actualRelocationTable = ConstantExpr::getPointerCast(next, ptr);
+
+                reserveTable(m, next, relocationTableType);
             }
 
             // Rewrite global references to use the relocation table
-            size_t index = 0;
-            for(Constant* c : referencedValues) {
-                for(Use* u : references[c]) {
+            for(size_t index = 0; index < referencedValues.size(); index++) {
+                Constant* c = referencedValues[index];
+
+                for(Use* u : *referencedUses[index]) {
                     Instruction* insertion_point = dyn_cast<Instruction>(u->getUser());
                     assert(insertion_point != NULL && "Only instruction uses can be rewritten");
 
@@ -504,11 +620,9 @@ struct StabilizerImpl {
 
                     u->set(loaded);
                 }
-
-                index++;
             }
 
-            vector<Value*> args;
+            vector<Constant*> args;
 
             // The function base
             args.push_back(ConstantExpr::getPointerCast(&f, Type::getInt8PtrTy(m.getContext())));
@@ -522,13 +636,16 @@ struct StabilizerImpl {
             // The size of the relocation table
             args.push_back(ConstantExpr::getIntegerCast(ConstantExpr::getSizeOf(relocationTableType), Type::getInt32Ty(m.getContext()), false));
 
+            // The number of direct call slots at the start of the table
+            args.push_back(Constant::getIntegerValue(Type::getInt32Ty(m.getContext()), APInt(32, calls.size(), false)));
+
             // If true, the function uses an adjacent relocation table, not the global
             args.push_back(Constant::getIntegerValue(Type::getInt1Ty(m.getContext()), APInt(1, isDataPCRelative(m), false)));
 
             return args;
 
         } else {
-            vector<Value*> args;
+            vector<Constant*> args;
 
             // The function base
             args.push_back(ConstantExpr::getPointerCast(&f, Type::getInt8PtrTy(m.getContext())));
@@ -542,6 +659,9 @@ struct StabilizerImpl {
             // The size of the relocation table (0)
             args.push_back(Constant::getIntegerValue(Type::getInt32Ty(m.getContext()), APInt(32, 0, false)));
 
+            // The number of direct call slots (0)
+            args.push_back(Constant::getIntegerValue(Type::getInt32Ty(m.getContext()), APInt(32, 0, false)));
+
             // PC-relative data?  Doesn't matter
             args.push_back(Constant::getIntegerValue(Type::getInt1Ty(m.getContext()), APInt(1, 0, false)));
 
@@ -549,6 +669,64 @@ struct StabilizerImpl {
         }
     }
 
+    /**
+     * \brief Replace the dummy function's body with room for the relocation table.
+     * The runtime fills it in when code randomization is switched off, so the
+     * original function can run in place.
+     *
+     * \arg m The module being transformed
+     * \arg next The dummy function placed after the transformed function
+     * \arg tableType The type of the function's relocation table
+     */
+    void reserveTable(Module& m, Function* next, Type* tableType) {
+        uint64_t size = m.getDataLayout().getTypeAllocSize(tableType);
+
+        BasicBlock& b = next->getEntryBlock();
+        b.getTerminator()->eraseFromParent();
+
+        // A naked function has no prologue, so the space starts at the function's address
+        InlineAsm* space = InlineAsm::get(
+            FunctionType::get(Type::getVoidTy(m.getContext()), false),
+            ".zero " + to_string(size),
+            "",
+            true
+        );
+
+        CallInst::Create(space, "", &b);
+        new UnreachableInst(m.getContext(), &b);
+
+        next->addFnAttr(Attribute::Naked);
+        next->addFnAttr(Attribute::NoInline);
+        next->addFnAttr(Attribute::NoUnwind);
+    }
+
+    /**
+     * \brief Build a function table record, with every field widened to pointer size
+     * \arg m The module being transformed
+     * \arg fields The code base, code limit, table, table size, call slots, adjacent flag, and stack pad
+     * \returns The record, matching the runtime's FunctionRecord
+     */
+    Constant* makeFunctionRecord(Module& m, vector<Constant*>& fields) {
+        Type* ptr_t = Type::getInt8PtrTy(m.getContext());
+        Type* intptr_type = Type::getIntNTy(m.getContext(), getIntptrSize(m));
+
+        vector<Constant*> widened;
+        for(Constant* c : fields) {
+            if(c->getType()->isPointerTy()) {
+                widened.push_back(ConstantExpr::getPointerCast(c, ptr_t));
+            } else {
+                widened.push_back(ConstantExpr::getIntegerCast(c, intptr_type, false));
+            }
+        }
+
+        vector<Type*> types;
+        for(Constant* c : widened) {
+            types.push_back(c->getType());
+        }
+
+        return ConstantStruct::get(StructType::get(m.getContext(), types), widened);
+    }
+
     /**
      * Check if a value is or contains a global value.
      */
@@ -629,6 +807,44 @@ struct StabilizerImpl {
         return result;
     }
 
+    /**
+     * \brief Move direct calls out of a set of PC-relative uses.
+     * A function used as the callee of a call gets a separate relocation
+     * table slot from any other use of its address, so the runtime can
+     * redirect calls without changing the value of escaping function pointers.
+     *
+     * \arg references The uses found by findPCRelativeUsesIn, with call targets removed on return
+     * \returns A map of all directly called functions, each with its set of callee uses
+     */
+    map<Constant*, set<Use*> > extractCallTargets(map<Constant*, set<Use*> >& references) {
+        map<Constant*, set<Use*> > result;
+
+        for(auto iter = references.begin(); iter != references.end(); ) {
+            if(isa<Function>(iter->first)) {
+                set<Use*>& uses = iter->second;
+
+                for(auto u = uses.begin(); u != uses.end(); ) {
+                    CallBase* call = dyn_cast<CallBase>((*u)->getUser());
+
+                    if(call != NULL && call->isCallee(*u)) {
+                        result[iter->first].insert(*u);
+                        u = uses.erase(u);
+                    } else {
+                        u++;
+                    }
+                }
+            }
+
+            if(iter->second.empty()) {
+                iter = references.erase(iter);
+            } else {
+                iter++;
+            }
+        }
+
+        return result;
+    }
+
     /**
      * \brief Replace certain floating point operations with function calls.
      * Some floating point operations (definitely int-to-float and float-to-int)
@@ -812,62 +1028,80 @@ struct StabilizerImpl {
 
     /**
      * \brief Replace all heap calls with references to Stabilizer's randomized
-     * heap.
+     * heap.  This covers the C allocation functions, the aligned allocation
+     * functions, functions that return heap memory, and every form of C++
+     * operator new and delete.  A replacement takes the same arguments as
+     * the function it replaces.
      *
      * \arg m The module to transform
      */
     void randomizeHeap(Module& m) {
-        Function *malloc_fn = m.getFunction("malloc");
-        Function *calloc_fn = m.getFunction("calloc");
-        Function *realloc_fn = m.getFunction("realloc");
-        Function *free_fn = m.getFunction("free");
-
-        if(malloc_fn) {
-            // void* stabilizer_malloc(size_t sz)
-            Function *stabilizer_malloc = Function::Create(
-                 malloc_fn->getFunctionType(),
-                 Function::ExternalLinkage,
-                 "stabilizer_malloc",
-                 &m
-            );
-
-            malloc_fn->replaceAllUsesWith(stabilizer_malloc);
-        }
-
-        if(calloc_fn) {
-            // void* stabilizer_calloc(size_t n, size_t sz)
-            Function *stabilizer_calloc = Function::Create(
-                 calloc_fn->getFunctionType(),
-                 Function::ExternalLinkage,
-                 "stabilizer_calloc",
-                 &m
-            );
-
-            calloc_fn->replaceAllUsesWith(stabilizer_calloc);
-        }
-
-        if(realloc_fn) {
-            // void* stabilizer_realloc(void *p, size_t sz)
-            Function *stabilizer_realloc = Function::Create(
-                 realloc_fn->getFunctionType(),
-                 Function::ExternalLinkage,
-                 "stabilizer_realloc",
-                 &m
-            );
-
-            realloc_fn->replaceAllUsesWith(stabilizer_realloc);
-        }
+        static const char* replacements[][2] = {
+            {"malloc", "stabilizer_malloc"},
+            {"calloc", "stabilizer_calloc"},
+            {"realloc", "stabilizer_realloc"},
+            {"free", "stabilizer_free"},
+            {"memalign", "stabilizer_memalign"},
+            {"aligned_alloc", "stabilizer_aligned_alloc"},
+            {"posix_memalign", "stabilizer_posix_memalign"},
+            {"malloc_usable_size", "stabilizer_malloc_usable_size"},
+            {"strdup", "stabilizer_strdup"},
+            {"__strdup", "stabilizer_strdup"},
+            {"strndup", "stabilizer_strndup"},
+            {"__strndup", "stabilizer_strndup"},
+
+            // operator new and new[], with a 64 (m) or 32 (j) bit size_t
+            {"_Znwm", "stabilizer_new"},
+            {"_Znam", "stabilizer_new"},
+            {"_Znwj", "stabilizer_new"},
+            {"_Znaj", "stabilizer_new"},
+            {"_ZnwmRKSt9nothrow_t", "stabilizer_new_nothrow"},
+            {"_ZnamRKSt9nothrow_t", "stabilizer_new_nothrow"},
+            {"_ZnwjRKSt9nothrow_t", "stabilizer_new_nothrow"},
+            {"_ZnajRKSt9nothrow_t", "stabilizer_new_nothrow"},
+            {"_ZnwmSt11align_val_t", "stabilizer_new_aligned"},
+            {"_ZnamSt11align_val_t", "stabilizer_new_aligned"},
+            {"_ZnwjSt11align_val_t", "stabilizer_new_aligned"},
+            {"_ZnajSt11align_val_t", "stabilizer_new_aligned"},
+            {"_ZnwmSt11align_val_tRKSt9nothrow_t", "stabilizer_new_aligned_nothrow"},
+            {"_ZnamSt11align_val_tRKSt9nothrow_t", "stabilizer_new_aligned_nothrow"},
+            {"_ZnwjSt11align_val_tRKSt9nothrow_t", "stabilizer_new_aligned_nothrow"},
+            {"_ZnajSt11align_val_tRKSt9nothrow_t", "stabilizer_new_aligned_nothrow"},
+
+            // operator delete and delete[], plain, sized, aligned, and nothrow
+            {"_ZdlPv", "stabilizer_delete"},
+            {"_ZdaPv", "stabilizer_delete"},
+            {"_ZdlPvm", "stabilizer_delete_sized"},
+            {"_ZdaPvm", "stabilizer_delete_sized"},
+            {"_ZdlPvj", "stabilizer_delete_sized"},
+            {"_ZdaPvj", "stabilizer_delete_sized"},
+            {"_ZdlPvSt11align_val_t", "stabilizer_delete_aligned"},
+            {"_ZdaPvSt11align_val_t", "stabilizer_delete_aligned"},
+            {"_ZdlPvmSt11align_val_t", "stabilizer_delete_sized_aligned"},
+            {"_ZdaPvmSt11align_val_t", "stabilizer_delete_sized_aligned"},
+            {"_ZdlPvjSt11align_val_t", "stabilizer_delete_sized_aligned"},
+            {"_ZdaPvjSt11align_val_t", "stabilizer_delete_sized_aligned"},
+            {"_ZdlPvRKSt9nothrow_t", "stabilizer_delete_nothrow"},
+            {"_ZdaPvRKSt9nothrow_t", "stabilizer_delete_nothrow"},
+            {"_ZdlPvSt11align_val_tRKSt9nothrow_t", "stabilizer_delete_aligned_nothrow"},
+            {"_ZdaPvSt11align_val_tRKSt9nothrow_t", "stabilizer_delete_aligned_nothrow"}
+        };
+
+        for(size_t i=0; i<sizeof(replacements) / sizeof(replacements[0]); i++) {
+            Function *fn = m.getFunction(replacements[i][0]);
+
+            // Leave allocators the program defines itself alone
+            if(fn == NULL || !fn->isDeclaration()) {
+                continue;
+            }
 
-        if(free_fn) {
-            // void stabilizer_free(void *p)
-            Function *stabilizer_free = Function::Create(
-                 free_fn->getFunctionType(),
-                 Function::ExternalLinkage,
-                 "stabilizer_free",
-                 &m
-            );
+            // Several functions can share a replacement, which is declared once
+            Constant *replacement = cast<Constant>(m.getOrInsertFunction(
+                replacements[i][1],
+                fn->getFunctionType()
+            ).getCallee());
 
-            free_fn->replaceAllUsesWith(stabilizer_free);
+            fn->replaceAllUsesWith(ConstantExpr::getBitCast(replacement, fn->getType()));
         }
     }
 
@@ -876,26 +1110,17 @@ struct StabilizerImpl {
      * \arg m The module to transform
      */
     void declareRuntimeFunctions(Module& m) {
-        // Declare the register_function runtime function
-        // void stabilizer_register_function(
-        //    void* codeBase, void* codeLimit, void* tableBase, size_t tableSize,
-        //    bool adjacent, uint8_t* stackPad)
-        vector<Type*> register_function_params;
-        register_function_params.push_back(Type::getInt8PtrTy(m.getContext()));
-        register_function_params.push_back(Type::getInt8PtrTy(m.getContext()));
-        register_function_params.push_back(Type::getInt8PtrTy(m.getContext()));
-        register_function_params.push_back(Type::getInt32Ty(m.getContext()));
-        register_function_params.push_back(Type::getInt1Ty(m.getContext()));
-        register_function_params.push_back(Type::getInt8PtrTy(m.getContext()));
-
-        registerFunction = Function::Create(
-             FunctionType::get(Type::getVoidTy(m.getContext()), register_function_params, false),
+        // Declare the register_functions runtime function
+        // void stabilizer_register_functions(FunctionRecord* records, size_t count)
+        registerFunctions = Function::Create(
+             FunctionType::get(Type::getVoidTy(m.getContext()),
+                {Type::getInt8PtrTy(m.getContext()), Type::getIntNTy(m.getContext(), getIntptrSize(m))}, false),
              Function::ExternalLinkage,
-             "stabilizer_register_function",
+             "stabilizer_register_functions",
              &m
         );
 
-        registerFunction->addFnAttr(Attribute::NonLazyBind);
+        registerFunctions->addFnAttr(Attribute::NonLazyBind);
 
         // Declare the register_constructor runtime function
         // void stabilizer_register_constructor(void* ctor)
@@ -910,7 +1135,7 @@ struct StabilizerImpl {
         registerConstructor->addFnAttr(Attribute::NonLazyBind);
 
         // Declare the register_stack_table runtime function
-        // void stabilizer_register_stack_pad(uint8_t* pad)
+        // void stabilizer_register_stack_pad(uintptr_t* pad)
         registerStackPad = Function::Create(
             FunctionType::get(Type::getVoidTy(m.getContext()),
                 {Type::getInt8PtrTy(m.getContext())}, false),
@@ -920,6 +1145,59 @@ struct StabilizerImpl {
         );
 
         registerStackPad->addFnAttr(Attribute::NonLazyBind);
+
+        // Declare the use_direct_calls runtime function
+        // void stabilizer_use_direct_calls()
+        useDirectCalls = Function::Create(
+            FunctionType::get(Type::getVoidTy(m.getContext()), false),
+            Function::ExternalLinkage,
+            "stabilizer_use_direct_calls",
+            &m
+        );
+
+        useDirectCalls->addFnAttr(Attribute::NonLazyBind);
+
+        // Declare the use_safepoints runtime function
+        // void stabilizer_use_safepoints()
+        useSafepoints = Function::Create(
+            FunctionType::get(Type::getVoidTy(m.getContext()), false),
+            Function::ExternalLinkage,
+            "stabilizer_use_safepoints",
+            &m
+        );
+
+        useSafepoints->addFnAttr(Attribute::NonLazyBind);
+
+        // Declare the use_heap runtime function
+        // void stabilizer_use_heap()
+        useHeap = Function::Create(
+            FunctionType::get(Type::getVoidTy(m.getContext()), false),
+            Function::ExternalLinkage,
+            "stabilizer_use_heap",
+            &m
+        );
+
+        useHeap->addFnAttr(Attribute::NonLazyBind);
+
+        // Declare the safepoint runtime function
+        // void stabilizer_safepoint()
+        safepoint = Function::Create(
+            FunctionType::get(Type::getVoidTy(m.getContext()), false),
+            Function::ExternalLinkage,
+            "stabilizer_safepoint",
+            &m
+        );
+
+        // Declare the flag the runtime sets when an epoch is due
+        // volatile int32_t stabilizer_epoch_pending
+        epochPending = new GlobalVariable(
+            m,
+            Type::getInt32Ty(m.getContext()),
+            false,
+            GlobalValue::ExternalLinkage,
+            NULL,
+            "stabilizer_epoch_pending"
+        );
     }
 };
 
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Arch.h"
+#include "CallSites.h"
+#include "Debug.h"
+
+#if IS_LINUX
+#include <elf.h>
+#include <link.h>
+#endif
+
+using namespace std;
+
+#if IS_LINUX
+
+#ifndef R_X86_64_GOTPCRELX
+#define R_X86_64_GOTPCRELX 41
+#endif
+
+#ifndef R_X86_64_REX_GOTPCRELX
+#define R_X86_64_REX_GOTPCRELX 42
+#endif
+
+/**
+ * Get the load bias of the main executable (zero unless it is position-independent)
+ */
+static int getBias(struct dl_phdr_info* info, size_t size, void* data) {
+    // The first object reported is always the executable
+    *(uintptr_t*)data = info->dlpi_addr;
+    return 1;
+}
+
+/**
+ * Check if a relocation fills in a 32 bit PC-relative displacement
+ */
+static bool isPCRelative32(uintptr_t info) {
+    _X86_64(return ELF64_R_TYPE(info) == R_X86_64_PC32 || ELF64_R_TYPE(info) == R_X86_64_PLT32);
+    _X86(return ELF32_R_TYPE(info) == R_386_PC32 || ELF32_R_TYPE(info) == R_386_PLT32);
+    return false;
+}
+
+/**
+ * Check if a relocation fills in a 32 bit PC-relative displacement to a GOT
+ * entry.  The linker may have relaxed the instruction to refer to the symbol
+ * directly, or to an immediate, without changing the relocation's type.
+ */
+static bool isGOTRelative32(uintptr_t info) {
+    _X86_64(return ELF64_R_TYPE(info) == R_X86_64_GOTPCREL || ELF64_R_TYPE(info) == R_X86_64_GOTPCRELX
+        || ELF64_R_TYPE(info) == R_X86_64_REX_GOTPCRELX || ELF64_R_TYPE(info) == R_X86_64_GOTTPOFF);
+    return false;
+}
+
+/**
+ * Check if a relocation is PC-relative in a way the runtime can't patch in a
+ * copy: narrow displacements, and TLS sequences the linker rewrites whole
+ */
+static bool isUnsupportedPCRelative(uintptr_t info) {
+    _X86_64(switch(ELF64_R_TYPE(info)) {
+        case R_X86_64_PC8:
+        case R_X86_64_PC16:
+        case R_X86_64_GOTPC32:
+        case R_X86_64_TLSGD:
+        case R_X86_64_TLSLD:
+        case R_X86_64_GOTPC32_TLSDESC:
+            return true;
+        default:
+            return false;
+    });
+    return false;
+}
+
+/**
+ * Get the symbol table index a relocation refers to
+ */
+static size_t getSymbolIndex(uintptr_t info) {
+    _X86_64(return ELF64_R_SYM(info));
+    _X86(return ELF32_R_SYM(info));
+    return 0;
+}
+
+/**
+ * Find the address a PC-relative relocation refers to.  A named symbol is
+ * exact.  A section symbol's addend holds the offset into the section, less
+ * the four bytes from the displacement to the end of a plain instruction.
+ * Rel entries and undefined symbols (reached through the PLT) have no usable
+ * addend or symbol, so the displacement in the file gives the target instead.
+ * \arg fd The executable
+ * \arg text The section the relocation applies to
+ * \arg symbol The relocation's symbol
+ * \arg offset The address of the displacement, before the load bias
+ * \arg addend The relocation's addend, or NULL for a Rel entry
+ * \returns The target address, before the load bias
+ */
+static uintptr_t getTarget(int fd, ElfW(Shdr)& text, ElfW(Sym)& symbol, uintptr_t offset, ElfW(Sxword)* addend) {
+    if(addend != NULL && symbol.st_shndx != SHN_UNDEF) {
+        if(ELF64_ST_TYPE(symbol.st_info) == STT_SECTION) {
+            return symbol.st_value + *addend + sizeof(int32_t);
+        } else {
+            return symbol.st_value;
+        }
+    }
+    
+    int32_t disp = 0;
+    (void) pread(fd, &disp, sizeof(disp), text.sh_offset + offset - text.sh_addr);
+    return offset + sizeof(int32_t) + disp;
+}
+
+/**
+ * Find the displacement a GOT-relative relocation left in the linked code.
+ * Unrelaxed, and relaxed to lea or a test against memory, the relocation
+ * still covers a RIP-relative operand.  A call relaxes to an addr32 call,
+ * whose displacement stays in place, and lld relaxes a jmp to a jmp and a
+ * nop, which moves it back a byte.  A move of an immediate has no
+ * displacement left.
+ * \arg fd The executable
+ * \arg text The section the relocation applies to
+ * \arg offset The relocation's offset, before the load bias
+ * \arg site Set to the address of the displacement, before the load bias
+ * \returns false if the instruction no longer has a PC-relative displacement
+ */
+static bool getGOTSite(int fd, ElfW(Shdr)& text, uintptr_t offset, uintptr_t& site) {
+    // The opcode and ModRM byte ahead of the displacement
+    uint8_t code[2];
+    if(offset < text.sh_addr + sizeof(code)
+        || pread(fd, code, sizeof(code), text.sh_offset + offset - sizeof(code) - text.sh_addr) != sizeof(code)) {
+        return false;
+    }
+    
+    if(code[0] == 0xe9) {
+        site = offset - 1;
+        return true;
+    } else if(code[1] == 0xe8 || code[1] == 0xe9 || (code[1] & 0xc7) == 0x05) {
+        site = offset;
+        return true;
+    }
+    
+    return false;
+}
+
+/**
+ * Read every PC-relative displacement in the executable's text
+ * \arg sites Filled in with the displacements and their targets, in the executable's address space
+ * \arg unsupported Filled in with the addresses of PC-relative relocations that can't be patched
+ * \returns false if the executable has no relocations for its text
+ */
+static bool readSites(vector<CodeSite>& sites, vector<uintptr_t>& unsupported) {
+    uintptr_t bias = 0;
+    dl_iterate_phdr(getBias, &bias);
+    
+    int fd = open("/proc/self/exe", O_RDONLY);
+    if(fd == -1) {
+        perror("Unable to open /proc/self/exe");
+        return false;
+    }
+    
+    ElfW(Ehdr) ehdr;
+    if(pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr)) {
+        close(fd);
+        return false;
+    }
+    
+    vector<ElfW(Shdr)> sections(ehdr.e_shnum);
+    size_t sectionsSize = ehdr.e_shnum * sizeof(ElfW(Shdr));
+    if(pread(fd, &sections[0], sectionsSize, ehdr.e_shoff) != (ssize_t)sectionsSize) {
+        close(fd);
+        return false;
+    }
+    
+    bool found = false;
+    
+    for(size_t i=0; i<sections.size(); i++) {
+        ElfW(Shdr)& s = sections[i];
+        
+        // Only look at relocations applied to executable sections
+        if((s.sh_type != SHT_RELA && s.sh_type != SHT_REL) || s.sh_info >= sections.size()
+            || !(sections[s.sh_info].sh_flags & SHF_EXECINSTR)) {
+            continue;
+        }
+        
+        found = true;
+        
+        vector<uint8_t> entries(s.sh_size);
+        if(s.sh_size == 0 || pread(fd, &entries[0], s.sh_size, s.sh_offset) != (ssize_t)s.sh_size) {
+            continue;
+        }
+        
+        // The symbol table the relocations refer to
+        if(s.sh_link >= sections.size()) {
+            continue;
+        }
+        
+        ElfW(Shdr)& symtab = sections[s.sh_link];
+        vector<ElfW(Sym)> symbols(symtab.sh_size / sizeof(ElfW(Sym)));
+        if(symbols.empty() || pread(fd, &symbols[0], symtab.sh_size, symtab.sh_offset) != (ssize_t)symtab.sh_size) {
+            continue;
+        }
+        
+        for(size_t off = 0; off + s.sh_entsize <= s.sh_size && s.sh_entsize > 0; off += s.sh_entsize) {
+            // Rel and Rela entries both start with r_offset and r_info
+            ElfW(Rel)* r = (ElfW(Rel)*)&entries[off];
+            
+            if(isPCRelative32(r->r_info) && getSymbolIndex(r->r_info) < symbols.size()) {
+                ElfW(Sxword)* addend = s.sh_type == SHT_RELA ? &((ElfW(Rela)*)r)->r_addend : NULL;
+                
+                CodeSite site;
+                site.address = r->r_offset + bias;
+                site.target = getTarget(fd, sections[s.sh_info], symbols[getSymbolIndex(r->r_info)], r->r_offset, addend) + bias;
+                sites.push_back(site);
+                
+            } else if(isGOTRelative32(r->r_info)) {
+                // The displacement in the file gives the GOT entry or the symbol it was relaxed to
+                uintptr_t address;
+                if(getGOTSite(fd, sections[s.sh_info], r->r_offset, address)) {
+                    CodeSite site;
+                    site.address = address + bias;
+                    site.target = getTarget(fd, sections[s.sh_info], symbols[0], address, NULL) + bias;
+                    sites.push_back(site);
+                }
+                
+            } else if(isUnsupportedPCRelative(r->r_info)) {
+                unsupported.push_back(r->r_offset + bias);
+            }
+        }
+    }
+    
+    close(fd);
+    
+    sort(sites.begin(), sites.end());
+    sort(unsupported.begin(), unsupported.end());
+    return found;
+}
+
+void findCallSites(vector<Function*>& functions) {
+    vector<CodeSite> sites;
+    vector<uintptr_t> unsupported;
+    
+    if(!readSites(sites, unsupported)) {
+        ABORT("Direct calls need the executable's relocations; link with -Wl,--emit-relocs");
+    }
+    
+    DEBUG("Found %lu PC-relative sites in text", (unsigned long)sites.size());
+    
+    for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        Function* f = *iter;
+        
+        CodeSite base = { (uintptr_t)f->getCodeBase(), 0 };
+        CodeSite limit = { base.address + f->getCodeSize(), 0 };
+        
+        const CodeSite* end = sites.data() + sites.size();
+        const CodeSite* first = lower_bound((const CodeSite*)sites.data(), end, base);
+        const CodeSite* last = lower_bound(first, end, limit);
+        
+        vector<uintptr_t>::iterator u = lower_bound(unsupported.begin(), unsupported.end(), base.address);
+        if(u != unsupported.end() && *u < limit.address) {
+            ABORT("Function at %p has a PC-relative reference at %p that can't be patched when it moves", f->getCodeBase(), (void*)*u);
+        }
+        
+        f->setCallSites(first, last);
+    }
+}
+
+#else
+
+void findCallSites(vector<Function*>& functions) {
+    ABORT("Direct calls are only supported for ELF executables");
+}
+
+#endif
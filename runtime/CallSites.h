@@ -0,0 +1,16 @@
+#if !defined(RUNTIME_CALLSITES_H)
+#define RUNTIME_CALLSITES_H
+
+#include <vector>
+
+#include "Function.h"
+
+/**
+ * Give each function the PC-relative displacement fields inside its code, so
+ * they can be patched when the function is copied.  Sites come from the
+ * relocations the static linker keeps with --emit-relocs.
+ * \arg functions All registered functions
+ */
+void findCallSites(std::vector<Function*>& functions);
+
+#endif
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "ChunkSource.h"
+#include "Debug.h"
+#include "Threads.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/**
+ * A run of free chunks.  The record lives in the first chunk of the run.
+ */
+struct FreeRun {
+    FreeRun* next;
+    size_t chunks;
+};
+
+/**
+ * Free single chunks, which small object heaps take and give back
+ */
+struct Shard {
+    SpinLock lock;
+    FreeRun* free;
+};
+
+static Shard shards[ChunkShards];
+
+/// Free runs of more than one chunk, left by large objects
+static SpinLock runLock;
+static FreeRun* runs = NULL;
+
+/// Picks the free run a large object reuses, so reuse does not fix its placement
+static RandomNumberGenerator runRng;
+static const size_t RunChoices = 16;
+
+static uintptr_t regionBase = 0;
+static uintptr_t regionLimit = 0;
+
+/// The first chunk that has never been handed out
+static uintptr_t regionNext = 0;
+
+/**
+ * Reserve the data heap's address space, aligned to the chunk size.  Pages
+ * are only made accessible as chunks are handed out.
+ */
+static bool reserve() {
+    void* p = mmap(NULL, RegionSize + ChunkSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(p == MAP_FAILED) {
+        ABORT("Couldn't reserve address space for the data heap");
+    }
+    
+    regionBase = ((uintptr_t)p + ChunkSize - 1) & ~(uintptr_t)(ChunkSize - 1);
+    regionLimit = regionBase + RegionSize;
+    regionNext = regionBase;
+    
+    DEBUG("Reserved data heap at %p, %lu bytes", (void*)regionBase, (unsigned long)RegionSize);
+    return true;
+}
+
+/**
+ * Take a run of exactly n chunks from a free list
+ */
+static void* take(FreeRun*& list, size_t n) {
+    for(FreeRun** r = &list; *r != NULL; r = &(*r)->next) {
+        if((*r)->chunks == n) {
+            FreeRun* run = *r;
+            *r = run->next;
+            return run;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Take one of the first RunChoices free runs of at least n chunks, at
+ * random.  Called with runLock held.
+ */
+static FreeRun* takeRandomRun(size_t n) {
+    FreeRun** choices[RunChoices];
+    size_t count = 0;
+    
+    for(FreeRun** r = &runs; *r != NULL && count < RunChoices; r = &(*r)->next) {
+        if((*r)->chunks >= n) {
+            choices[count++] = r;
+        }
+    }
+    
+    if(count == 0) {
+        return NULL;
+    }
+    
+    FreeRun** r = choices[runRng.next() % count];
+    FreeRun* run = *r;
+    *r = run->next;
+    return run;
+}
+
+/**
+ * Put chunks whose pages are already released on a free list
+ */
+static void pushRun(void* p, size_t n, size_t shard) {
+    FreeRun* run = (FreeRun*)p;
+    run->chunks = n;
+    
+    if(n == 1) {
+        Shard& s = shards[shard % ChunkShards];
+        s.lock.lock();
+        run->next = s.free;
+        s.free = run;
+        s.lock.unlock();
+    } else {
+        runLock.lock();
+        run->next = runs;
+        runs = run;
+        runLock.unlock();
+    }
+}
+
+void* allocateChunks(size_t n, size_t shard) {
+    static bool reserved = reserve();
+    (void)reserved;
+    
+    void* p = NULL;
+    
+    if(n == 1) {
+        // Look in this heap's shard, then steal from the others before using fresh memory
+        for(size_t i=0; i<ChunkShards && p == NULL; i++) {
+            Shard& s = shards[(shard + i) % ChunkShards];
+            
+            if(s.free != NULL) {
+                s.lock.lock();
+                p = take(s.free, 1);
+                s.lock.unlock();
+            }
+        }
+    } else if(runs != NULL) {
+        runLock.lock();
+        FreeRun* run = takeRandomRun(n);
+        runLock.unlock();
+        
+        // Give back the chunks past the first n
+        if(run != NULL && run->chunks > n) {
+            pushRun((uint8_t*)run + n * ChunkSize, run->chunks - n, shard);
+        }
+        p = run;
+    }
+    
+    if(p != NULL) {
+        return p;
+    }
+    
+    // Only advance past fresh memory that fits, so a failed request does not use up the rest of the region
+    uintptr_t base = __atomic_load_n(&regionNext, __ATOMIC_RELAXED);
+    do {
+        if(n > (regionLimit - base) / ChunkSize) {
+            return NULL;
+        }
+    } while(!__atomic_compare_exchange_n(&regionNext, &base, base + n * ChunkSize, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    
+    if(mprotect((void*)base, n * ChunkSize, PROT_READ | PROT_WRITE)) {
+        return NULL;
+    }
+    
+    return (void*)base;
+}
+
+void freeChunks(void* p, size_t n, size_t shard) {
+    // Keep the address space, but give the pages back
+    madvise(p, n * ChunkSize, MADV_DONTNEED);
+    pushRun(p, n, shard);
+}
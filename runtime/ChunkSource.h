@@ -0,0 +1,46 @@
+#if !defined(RUNTIME_CHUNKSOURCE_H)
+#define RUNTIME_CHUNKSOURCE_H
+
+#include "Util.h"
+
+/**
+ * The data heap's memory.  One large block of address space is reserved the
+ * first time it is needed and handed out in ChunkSize-aligned chunks, so an
+ * object's chunk is found by masking off the low bits.  Freed chunks go back
+ * on one of several shards, each with its own lock, so threads rarely
+ * contend for memory.
+ */
+enum {
+    ChunkSize = 0x100000,
+    ChunkShards = 16
+};
+
+/// The address space reserved for the data heap, so no request can be larger
+static const size_t RegionSize = sizeof(void*) == 8 ? (size_t)1 << 36 : (size_t)1 << 30;
+
+/**
+ * \brief Get memory for one or more contiguous chunks.  Several chunks come
+ * from a random free run that is large enough, split if it is larger, or
+ * from fresh space.
+ * \arg n The number of chunks
+ * \arg shard The calling heap's shard, where single chunks are looked for first
+ * \returns The first chunk, or NULL if the reserved block is used up
+ */
+void* allocateChunks(size_t n, size_t shard);
+
+/**
+ * \brief Give chunks back.  Their pages are released to the system.
+ * \arg p The first chunk, as returned by allocateChunks
+ * \arg n The number of chunks
+ * \arg shard The calling heap's shard
+ */
+void freeChunks(void* p, size_t n, size_t shard);
+
+/**
+ * \brief Get the base of the chunk holding an address
+ */
+static inline void* getChunk(void* p) {
+    return (void*)((uintptr_t)p & ~(uintptr_t)(ChunkSize - 1));
+}
+
+#endif
@@ -0,0 +1,243 @@
+#include "CodeArena.h"
+#include "CodeRegion.h"
+#include "Config.h"
+#include "Heap.h"
+#include "Threads.h"
+
+enum {
+    /// An arena tracks at most this many free ranges
+    MaxRanges = 64,
+    
+    /// Once an arena's range table is full, copies go at either end of a range, after a random gap of up to this many alignment blocks
+    MaxGap = 16
+};
+
+/**
+ * A free range of an arena, from base up to (not including) limit
+ */
+struct FreeRange {
+    uintptr_t base;
+    uintptr_t limit;
+};
+
+/**
+ * One epoch's share of the code region
+ */
+struct Arena {
+    void* base;                     //< The writable address of the arena's slot
+    FreeRange free[MaxRanges];      //< The parts of the slot no copy has been placed in
+    size_t ranges;                  //< The number of entries in free
+    size_t live;                    //< Copies allocated here and not yet freed
+    bool used;
+};
+
+static bool enabled = false;
+
+/// Arenas are indexed by their code region slot
+static Arena arenas[CodeRegion::MaxSlots];
+
+/// The arena copies are placed in, or NULL until the epoch's first copy
+static Arena* current = NULL;
+
+static size_t released = 0;
+
+/// The pre-copy thread allocates alongside relocations under runtimeLock
+static SpinLock arenaLock;
+
+static RandomNumberGenerator rng;
+
+/**
+ * Find the arena holding an address
+ */
+static Arena* findArena(void* p) {
+    ssize_t slot = getCodeRegion()->slotOf(p);
+    
+    if(slot >= 0 && arenas[slot].used) {
+        return &arenas[slot];
+    } else {
+        return NULL;
+    }
+}
+
+/**
+ * Give a whole arena back to the code region
+ */
+static void release(Arena* a) {
+    a->used = false;
+    getCodeRegion()->free(a->base, CodeRegion::SlotSize);
+    released++;
+}
+
+/**
+ * Start a fresh arena in a free region slot
+ * \returns The new arena, or NULL if the region is full
+ */
+static Arena* openArena() {
+    void* p = getCodeRegion()->malloc(CodeRegion::SlotSize);
+    if(p == NULL) {
+        return NULL;
+    }
+    
+    Arena* a = &arenas[getCodeRegion()->slotOf(p)];
+    a->base = p;
+    a->free[0].base = (uintptr_t)p;
+    a->free[0].limit = (uintptr_t)p + CodeRegion::SlotSize;
+    a->ranges = 1;
+    a->live = 0;
+    a->used = true;
+    
+    return a;
+}
+
+/**
+ * Carve a copy out of an arena, from a free range found by searching from a
+ * random one.  While the arena can track another range, the copy goes at a
+ * random aligned offset and the pieces on either side of it stay free.  After
+ * that it goes at a random gap from either end of the range, so a full table
+ * wastes no more than the gaps.
+ * \arg sz The size of the copy, a multiple of the code alignment
+ * \returns The copy, or NULL if no free range can hold it
+ */
+static void* carve(Arena* a, size_t sz) {
+    size_t align = getConfig().codeAlign;
+    size_t start = a->ranges > 0 ? rng.next() % a->ranges : 0;
+    
+    for(size_t n=0; n<a->ranges; n++) {
+        size_t i = (start + n) % a->ranges;
+        FreeRange r = a->free[i];
+        
+        if(r.limit - r.base < sz) {
+            continue;
+        }
+        
+        // Range ends stay aligned, since every copy is a multiple of the alignment
+        size_t blocks = (r.limit - r.base - sz) / align;
+        
+        if(a->ranges < MaxRanges) {
+            uintptr_t p = r.base + (rng.next() % (blocks + 1)) * align;
+            
+            if(p == r.base) {
+                a->free[i].base = p + sz;
+            } else {
+                a->free[i].limit = p;
+                
+                if(p + sz < r.limit) {
+                    a->free[a->ranges].base = p + sz;
+                    a->free[a->ranges].limit = r.limit;
+                    a->ranges++;
+                }
+            }
+            
+            return (void*)p;
+        }
+        
+        uintptr_t gap = (rng.next() % (blocks < MaxGap ? blocks + 1 : MaxGap)) * align;
+        
+        if(rng.next() & 1) {
+            a->free[i].base = r.base + gap + sz;
+            return (void*)(r.base + gap);
+        } else {
+            a->free[i].limit = r.limit - gap - sz;
+            return (void*)a->free[i].limit;
+        }
+    }
+    
+    return NULL;
+}
+
+void useCodeArenas() {
+    enabled = true;
+}
+
+void* allocateHeapCode(size_t sz) {
+    size_t align = getConfig().codeAlign;
+    
+    // Over-allocate, and keep the heap's pointer just below the aligned copy
+    uint8_t* base = (uint8_t*)getCodeHeap()->malloc(sz + align + sizeof(void*));
+    if(base == NULL) {
+        return NULL;
+    }
+    
+    uintptr_t p = ((uintptr_t)base + sizeof(void*) + align - 1) & ~(uintptr_t)(align - 1);
+    ((void**)p)[-1] = base;
+    
+    return (void*)p;
+}
+
+void* allocateCode(size_t sz) {
+    if(!enabled) {
+        return allocateHeapCode(sz);
+    }
+    
+    size_t align = getConfig().codeAlign;
+    sz = (sz + align - 1) & ~(size_t)(align - 1);
+    
+    arenaLock.lock();
+    
+    void* p = NULL;
+    
+    // A full arena is retired early, and the epoch continues in a new one
+    for(size_t tries=0; p == NULL && tries < 2; tries++) {
+        if(current == NULL) {
+            current = openArena();
+        }
+        
+        if(current == NULL) {
+            break;
+        }
+        
+        p = carve(current, sz);
+        
+        if(p != NULL) {
+            current->live++;
+        } else {
+            if(current->live == 0) {
+                release(current);
+            }
+            current = NULL;
+        }
+    }
+    
+    arenaLock.unlock();
+    
+    if(p == NULL) {
+        p = allocateHeapCode(sz);
+    }
+    
+    return p;
+}
+
+void freeCode(void* p) {
+    arenaLock.lock();
+    
+    Arena* a = findArena(p);
+    
+    if(a != NULL) {
+        a->live--;
+        
+        if(a->live == 0 && a != current) {
+            release(a);
+        }
+    }
+    
+    arenaLock.unlock();
+    
+    if(a == NULL) {
+        getCodeHeap()->free(((void**)p)[-1]);
+    }
+}
+
+void nextCodeArena() {
+    arenaLock.lock();
+    
+    if(current != NULL && current->live == 0) {
+        release(current);
+    }
+    current = NULL;
+    
+    arenaLock.unlock();
+}
+
+size_t getReleasedArenas() {
+    return released;
+}
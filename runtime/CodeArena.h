@@ -0,0 +1,54 @@
+#if !defined(RUNTIME_CODEARENA_H)
+#define RUNTIME_CODEARENA_H
+
+#include <stddef.h>
+
+/**
+ * Relocated code can be placed in epoch-owned arenas instead of the code
+ * heap.  Each arena is one slot of the near-text code region; every copy
+ * made in an epoch goes into that epoch's arena, at a random offset in one
+ * of its free ranges.  Each arena counts its live copies, and once an arena
+ * from a past epoch holds none its whole slot is released with a single
+ * madvise.  Without arenas (or once the region is full) these fall through
+ * to the code heap.
+ */
+
+/**
+ * \brief Place relocated code in per-epoch arenas from now on
+ */
+void useCodeArenas();
+
+/**
+ * \brief Allocate memory for a copy of a function, aligned as set by
+ * STABILIZER_CODE_ALIGN
+ * \arg sz The size of the copy, including any adjacent relocation table
+ * \returns Writable memory for the copy
+ */
+void* allocateCode(size_t sz);
+
+/**
+ * \brief Allocate memory for a copy of a function on the code heap, even
+ * when arenas are in use
+ * \arg sz The size of the copy, including any adjacent relocation table
+ * \returns Writable memory for the copy
+ */
+void* allocateHeapCode(size_t sz);
+
+/**
+ * \brief Free memory returned by allocateCode or allocateHeapCode,
+ * releasing its arena if the arena is retired and now empty
+ * \arg p The writable address returned by allocateCode
+ */
+void freeCode(void* p);
+
+/**
+ * \brief Retire the current arena, so copies made from here on go in a new one
+ */
+void nextCodeArena();
+
+/**
+ * \brief Get the number of arenas released so far
+ */
+size_t getReleasedArenas();
+
+#endif
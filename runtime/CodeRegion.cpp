@@ -0,0 +1,333 @@
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "CodeRegion.h"
+#include "Debug.h"
+
+#if IS_LINUX
+#include <link.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/// The largest displacement a rel32 jump can reach, less some slack for instruction lengths
+#define REL32_REACH (0x80000000UL - 0x100000UL)
+
+CodeRegion* getCodeRegion() {
+    static char buf[sizeof(CodeRegion)];
+    static CodeRegion* _theCodeRegion = new (buf) CodeRegion;
+    return _theCodeRegion;
+}
+
+#if IS_LINUX
+/**
+ * Find the executable segment of the main program
+ */
+static int findText(struct dl_phdr_info* info, size_t size, void* data) {
+    uintptr_t* range = (uintptr_t*)data;
+    
+    for(size_t i=0; i<info->dlpi_phnum; i++) {
+        const ElfW(Phdr)& p = info->dlpi_phdr[i];
+        
+        if(p.p_type == PT_LOAD && (p.p_flags & PF_X)) {
+            range[0] = info->dlpi_addr + p.p_vaddr;
+            range[1] = range[0] + p.p_memsz;
+        }
+    }
+    
+    // The first object reported is always the executable
+    return 1;
+}
+#endif
+
+CodeRegion::CodeRegion() {
+    _reserved = false;
+    _fd = -1;
+    _base = 0;
+    _writable = 0;
+    _slots = 0;
+    _huge = HugePagesOff;
+    _fallbacks = 0;
+    _fileSize = 0;
+    _segmentCount = 0;
+    memset(_used, 0, sizeof(_used));
+}
+
+void CodeRegion::reserve() {
+    _reserved = true;
+    
+#if IS_X86_64 && IS_LINUX
+    uintptr_t text[2] = { 0, 0 };
+    dl_iterate_phdr(findText, text);
+    
+#if defined(SYS_memfd_create)
+    _fd = syscall(SYS_memfd_create, "stabilizer-code", MFD_CLOEXEC);
+#endif
+    
+    // Try for the largest region that fits
+    for(size_t slots = MaxSlots; slots > 0 && text[1] != 0; slots /= 2) {
+        if(reserve(text[0], text[1], slots)) {
+            DEBUG("Reserved code region at %p, %lu bytes, writable at %p", getBase(), (unsigned long)getSize(), (void*)_writable);
+            return;
+        }
+    }
+    
+    fprintf(stderr, "Stabilizer: unable to reserve code near the program text, relocated functions may need far jumps\n");
+#endif
+}
+
+/**
+ * Map the region at a random address within rel32 range of the whole text
+ * segment.  MAP_FIXED_NOREPLACE fails instead of clobbering an existing
+ * mapping; older kernels treat it as a hint, so check where the map landed.
+ */
+bool CodeRegion::reserve(uintptr_t textBase, uintptr_t textLimit, size_t slots) {
+    size_t size = slots * SlotSize;
+    
+    // Every address in the region must be in range of every address in the text
+    uintptr_t low = textLimit > REL32_REACH ? textLimit - REL32_REACH : 0;
+    uintptr_t high = textBase + REL32_REACH - size;
+    
+    // Stay clear of the zero page
+    if(low < SlotSize) {
+        low = SlotSize;
+    }
+    
+    // Huge pages need the region to start on a 2MB boundary
+    size_t align = _huge == HugePagesOff ? PAGESIZE : HUGEPAGESIZE;
+    low = (low + align - 1) & ~(uintptr_t)(align - 1);
+    
+    if(high <= low) {
+        return false;
+    }
+    
+    size_t pages = (high - low) / align;
+    
+    // The file only takes memory as the heap touches it
+    if(_fd != -1 && ftruncate(_fd, size)) {
+        return false;
+    }
+    
+    for(size_t i=0; i<Probes; i++) {
+        uintptr_t hint = low + (_rng.next() % pages) * align;
+        
+        void* p;
+        if(_fd != -1) {
+            p = mmap((void*)hint, size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED_NOREPLACE, _fd, 0);
+        } else {
+            p = mmap((void*)hint, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+        }
+        
+        if(p == (void*)hint) {
+            _base = hint;
+            _writable = hint;
+            _slots = slots;
+            break;
+            
+        } else if(p != MAP_FAILED) {
+            munmap(p, size);
+        }
+    }
+    
+    if(_slots == 0) {
+        return false;
+    }
+    
+    // Map the writable alias anywhere; only the executable alias has to be near the text
+    if(_fd != -1) {
+        void* w = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        
+        if(w == MAP_FAILED) {
+            munmap((void*)_base, size);
+            _slots = 0;
+            return false;
+        }
+        
+        _writable = (uintptr_t)w;
+        _fileSize = size;
+    }
+    
+    return true;
+}
+
+void* CodeRegion::malloc(size_t sz) {
+    _lock.lock();
+    
+    if(!_reserved) {
+        reserve();
+    }
+    
+    size_t n = (sz + SlotSize - 1) / SlotSize;
+    
+    if(n <= _slots) {
+        // Look for a run of free slots, starting from a random one
+        size_t start = _rng.next() % (_slots - n + 1);
+        
+        for(size_t i=0; i<=_slots - n; i++) {
+            size_t s = (start + i) % (_slots - n + 1);
+            
+            size_t j = 0;
+            while(j < n && !_used[s + j]) {
+                j++;
+            }
+            
+            if(j == n) {
+                for(j=0; j<n; j++) {
+                    _used[s + j] = true;
+                }
+                
+                size_t offset = s * SlotSize;
+                
+                if(_fd != -1) {
+                    // Both aliases share pages, so the hugetlbfs pool can't be swapped in under one of them
+                    HugePageMode huge = _huge == HugePagesOff ? HugePagesOff : HugePagesAdvise;
+                    useHugePages((void*)(_base + offset), n * SlotSize, PROT_READ | PROT_EXEC, MAP_SHARED, huge);
+                    useHugePages((void*)(_writable + offset), n * SlotSize, PROT_READ | PROT_WRITE, MAP_SHARED, huge);
+                } else {
+                    useHugePages((void*)(_base + offset), n * SlotSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, _huge);
+                }
+                
+                _lock.unlock();
+                return (void*)(_writable + offset);
+            }
+        }
+    }
+    
+    // Only count misses once the region exists; targets without one never need it
+    if(_slots > 0) {
+        _fallbacks++;
+    }
+    
+    _lock.unlock();
+    return NULL;
+}
+
+void CodeRegion::free(void* p, size_t sz) {
+    ssize_t s = slotOf(p);
+    size_t n = (sz + SlotSize - 1) / SlotSize;
+    
+    if(s < 0) {
+        return;
+    }
+    
+    _lock.lock();
+    
+#if defined(MADV_REMOVE)
+    // Punch the pages out of the file, which drops them from both aliases
+    if(_fd != -1) {
+        madvise(p, n * SlotSize, MADV_REMOVE);
+    } else
+#endif
+    {
+        madvise(p, n * SlotSize, MADV_DONTNEED);
+    }
+    
+    for(size_t i=0; i<n; i++) {
+        _used[s + i] = false;
+    }
+    
+    _lock.unlock();
+}
+
+/**
+ * Extend the memfd and map the new part writable anywhere, as the start of a
+ * new segment.  Called with the lock held.
+ * \arg base The executable address the segment will have, which the caller maps
+ * \arg sz The size of the segment, a multiple of the page size
+ * \returns The writable alias, or NULL if there is no room
+ */
+void* CodeRegion::addSegment(void* base, size_t sz) {
+    if(_fd == -1 || _segmentCount == MaxSegments || ftruncate(_fd, _fileSize + sz)) {
+        return NULL;
+    }
+    
+    void* w = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, _fileSize);
+    if(w == MAP_FAILED) {
+        return NULL;
+    }
+    
+    Segment& s = _segments[_segmentCount];
+    s.base = (uintptr_t)base;
+    s.writable = (uintptr_t)w;
+    s.size = sz;
+    
+    return w;
+}
+
+void* CodeRegion::mallocFar(size_t sz) {
+    if(_fd == -1) {
+        return NULL;
+    }
+    
+    sz = (sz + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1);
+    
+    _lock.lock();
+    
+    void* x = NULL;
+    void* w = addSegment(NULL, sz);
+    
+    if(w != NULL) {
+        x = mmap(NULL, sz, PROT_READ | PROT_EXEC, MAP_SHARED, _fd, _fileSize);
+    }
+    
+    if(w == NULL || x == MAP_FAILED) {
+        if(w != NULL) {
+            munmap(w, sz);
+        }
+        _lock.unlock();
+        return NULL;
+    }
+    
+    HugePageMode huge = _huge == HugePagesOff ? HugePagesOff : HugePagesAdvise;
+    useHugePages(x, sz, PROT_READ | PROT_EXEC, MAP_SHARED, huge);
+    useHugePages(w, sz, PROT_READ | PROT_WRITE, MAP_SHARED, huge);
+    
+    _segments[_segmentCount].base = (uintptr_t)x;
+    _fileSize += sz;
+    __atomic_store_n(&_segmentCount, _segmentCount + 1, __ATOMIC_RELEASE);
+    
+    _lock.unlock();
+    return w;
+}
+
+bool CodeRegion::aliasText(void* p, size_t sz) {
+    _lock.lock();
+    
+    // The memfd is created along with the region
+    if(!_reserved) {
+        reserve();
+    }
+    
+    void* w = addSegment(p, sz);
+    if(w == NULL) {
+        _lock.unlock();
+        return false;
+    }
+    
+    // Fill the file with the text, then swap it in under the text's own address
+    memcpy(w, p, sz);
+    
+    if(mmap(p, sz, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, _fd, _fileSize) != p) {
+        ABORT("Unable to remap the program text at %p", p);
+    }
+    
+    _fileSize += sz;
+    __atomic_store_n(&_segmentCount, _segmentCount + 1, __ATOMIC_RELEASE);
+    
+    _lock.unlock();
+    return true;
+}
@@ -0,0 +1,200 @@
+#if !defined(RUNTIME_CODEREGION_H)
+#define RUNTIME_CODEREGION_H
+
+#include "Util.h"
+#include "MMapSource.h"
+#include "Threads.h"
+
+/**
+ * A contiguous block of address space reserved within rel32 range of the
+ * program's text, so forwarding jumps between the original code and its
+ * copies always fit in a 32 bit displacement.  The region is handed out in
+ * fixed-size slots, chosen at random.  The region is reserved on the first
+ * allocation, so the huge page mode can be set before then.
+ *
+ * Where memfd is available the region is a shared memory file mapped twice,
+ * so no page is ever writable and executable at once: the heap hands out
+ * (and copies code into) the writable alias, and code runs from the
+ * executable alias at a constant offset from it.  The program's text can be
+ * moved into the same file, so function headers are written the same way.
+ */
+struct CodeRegion {
+public:
+    enum {
+        SlotSize = 0x2000000,
+        MaxSlots = 32
+    };
+    
+private:
+    enum {
+        Probes = 16,
+        MaxSegments = 64
+    };
+    
+    /// Dual-mapped memory outside the region: the program's text, or allocations that no longer fit in the region
+    struct Segment {
+        uintptr_t base;
+        uintptr_t writable;
+        size_t size;
+    };
+    
+    bool _reserved;
+    int _fd;                //< The memfd backing both aliases, or -1 for a single RWX mapping
+    uintptr_t _base;        //< The executable alias
+    uintptr_t _writable;    //< The writable alias, or _base for a single mapping
+    size_t _slots;
+    bool _used[MaxSlots];
+    
+    HugePageMode _huge;     //< Whether slots are backed by 2MB pages
+    
+    size_t _fallbacks;      //< The number of allocations that did not fit in the region
+    
+    size_t _fileSize;       //< The length of the memfd, which backs the region and then each segment
+    Segment _segments[MaxSegments];
+    size_t _segmentCount;   //< Published with a release store, so lookups need no lock
+    
+    SpinLock _lock;         //< Both the code heap and the epoch arenas take slots
+    
+    RandomNumberGenerator _rng;
+    
+    void reserve();
+    bool reserve(uintptr_t textBase, uintptr_t textLimit, size_t slots);
+    void* addSegment(void* base, size_t sz);
+    
+    /**
+     * \brief Find the other alias of an address in a segment
+     * \arg p The address
+     * \arg executable If true, p is a writable address and its executable alias is returned
+     * \returns The other alias, or p if it is not in a segment
+     */
+    inline void* findSegment(void* p, bool executable) {
+        size_t n = __atomic_load_n(&_segmentCount, __ATOMIC_ACQUIRE);
+        
+        for(size_t i=0; i<n; i++) {
+            uintptr_t from = executable ? _segments[i].writable : _segments[i].base;
+            uintptr_t offset = (uintptr_t)p - from;
+            
+            if(offset < _segments[i].size) {
+                return (void*)((executable ? _segments[i].base : _segments[i].writable) + offset);
+            }
+        }
+        
+        return p;
+    }
+    
+public:
+    CodeRegion();
+    
+    /**
+     * \brief Back code with 2MB pages.  Code is still placed at the configured
+     * alignment, but a whole working set fits in a few iTLB entries.
+     * \arg mode How to get huge pages
+     */
+    inline void setHugePages(HugePageMode mode) {
+        _huge = mode;
+    }
+    
+    inline HugePageMode getHugePages() {
+        return _huge;
+    }
+    
+    /**
+     * \brief Allocate memory from a random run of free slots
+     * \arg sz The size of the allocation
+     * \returns The allocated memory, or NULL if the region has no room
+     */
+    void* malloc(size_t sz);
+    
+    /**
+     * \brief Return a run of slots to the region, discarding their pages
+     * \arg p The address malloc returned
+     * \arg sz The size passed to malloc
+     */
+    void free(void* p, size_t sz);
+    
+    /**
+     * \brief Extend the memfd and map the new part twice, anywhere, once the
+     * region is full.  Copies placed here may need far jumps, but like the
+     * region no page is ever writable and executable at once.
+     * \arg sz The size of the allocation
+     * \returns The writable alias, or NULL if there is no memfd or no room for another segment
+     */
+    void* mallocFar(size_t sz);
+    
+    /**
+     * \brief Move pages of the program's text into the memfd, mapped
+     * executable where they were and writable elsewhere, so toWritable finds
+     * a writable alias for code in them.  Called before any other thread can
+     * run the pages.
+     * \arg p The page-aligned start of the text to move
+     * \arg sz The size to move, a multiple of the page size
+     * \returns false if there is no memfd or no room for another segment; the pages are unchanged
+     */
+    bool aliasText(void* p, size_t sz);
+    
+    /**
+     * \brief Get the slot an address returned by malloc falls in
+     * \arg p A writable address
+     * \returns The slot index, or -1 if p is outside the region
+     */
+    inline ssize_t slotOf(void* p) {
+        uintptr_t offset = (uintptr_t)p - _writable;
+        return offset < getSize() ? (ssize_t)(offset / SlotSize) : -1;
+    }
+    
+    inline void* getBase() {
+        return (void*)_base;
+    }
+    
+    inline size_t getSize() {
+        return _slots * SlotSize;
+    }
+    
+    inline size_t getFallbacks() {
+        return _fallbacks;
+    }
+    
+    /**
+     * \brief Get the address code allocated at p runs from
+     * \arg p An address returned by the code heap
+     */
+    inline void* toExecutable(void* p) {
+        uintptr_t offset = (uintptr_t)p - _writable;
+        return offset < getSize() ? (void*)(_base + offset) : findSegment(p, true);
+    }
+    
+    /**
+     * \brief Get the address the runtime writes code running at p through
+     * \arg p An address in relocated code, or in text moved by aliasText
+     */
+    inline void* toWritable(void* p) {
+        uintptr_t offset = (uintptr_t)p - _base;
+        return offset < getSize() ? (void*)(_writable + offset) : findSegment(p, false);
+    }
+};
+
+CodeRegion* getCodeRegion();
+
+/**
+ * A source for the code heap that allocates from the near-text region, and
+ * falls back to dual-mapped far segments once the region is full.  Only
+ * targets without memfd fall back to an ordinary mapping.
+ */
+template<int Prot, int Flags> class CodeRegionSource : public MMapSource<Prot, Flags> {
+public:
+    inline void* malloc(size_t sz) {
+        void* ptr = getCodeRegion()->malloc(sz);
+        
+        if(ptr == NULL) {
+            ptr = getCodeRegion()->mallocFar(sz);
+        }
+        
+        if(ptr == NULL) {
+            ptr = MMapSource<Prot, Flags>::malloc(sz, getCodeRegion()->getHugePages());
+        }
+        
+        return ptr;
+    }
+};
+
+#endif
@@ -0,0 +1,245 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "Config.h"
+#include "Util.h"
+
+enum {
+    MaxFileSize = 8192,
+    MaxEntries = 128
+};
+
+/// The config file's contents, split in place into names and values
+static char file[MaxFileSize];
+
+static struct {
+    const char* name;
+    const char* value;
+} entries[MaxEntries];
+
+static size_t entryCount = 0;
+
+static bool trimmed(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/**
+ * Trim spaces from both ends of a string in place
+ */
+static char* trim(char* s) {
+    while(trimmed(*s)) {
+        s++;
+    }
+    
+    char* end = s + strlen(s);
+    while(end > s && trimmed(end[-1])) {
+        *--end = '\0';
+    }
+    
+    return s;
+}
+
+/**
+ * Read the file named by STABILIZER_CONFIG into the entry table.  This may
+ * run before main, so it uses the file descriptor calls instead of stdio.
+ * \returns true if a file was read
+ */
+static bool readFile() {
+    const char* path = getenv("STABILIZER_CONFIG");
+    if(path == NULL) {
+        return false;
+    }
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        fprintf(stderr, "Stabilizer: unable to open config file %s\n", path);
+        return false;
+    }
+    
+    size_t size = 0;
+    ssize_t n;
+    while(size < MaxFileSize - 1 && (n = read(fd, &file[size], MaxFileSize - 1 - size)) > 0) {
+        size += n;
+    }
+    close(fd);
+    
+    file[size] = '\0';
+    
+    char* line = file;
+    while(line != NULL) {
+        char* next = strchr(line, '\n');
+        if(next != NULL) {
+            *next++ = '\0';
+        }
+    
+        char* comment = strchr(line, '#');
+        if(comment != NULL) {
+            *comment = '\0';
+        }
+    
+        char* eq = strchr(line, '=');
+        if(eq != NULL) {
+            *eq = '\0';
+            char* name = trim(line);
+    
+            if(strncasecmp(name, "STABILIZER_", 11) == 0) {
+                name += 11;
+            }
+    
+            if(entryCount < MaxEntries) {
+                entries[entryCount].name = name;
+                entries[entryCount].value = trim(eq + 1);
+                entryCount++;
+            } else {
+                fprintf(stderr, "Stabilizer: too many options in %s, ignoring %s\n", path, name);
+            }
+        } else if(*trim(line) != '\0') {
+            fprintf(stderr, "Stabilizer: ignoring malformed line in %s: %s\n", path, trim(line));
+        }
+    
+        line = next;
+    }
+    
+    return true;
+}
+
+/**
+ * Read a numeric option
+ * \arg name The option's name
+ * \arg value Set to the option's value, if it is set and at least min
+ * \arg min The smallest valid value
+ */
+static void readSize(const char* name, size_t& value, size_t min) {
+    const char* s = getOption(name);
+    if(s == NULL) {
+        return;
+    }
+    
+    char* end;
+    unsigned long n = strtoul(s, &end, 0);
+    
+    if(end == s || *end != '\0' || n < min) {
+        fprintf(stderr, "Stabilizer: invalid value '%s' for %s, using %lu\n", s, name, (unsigned long)value);
+    } else {
+        value = n;
+    }
+}
+
+/**
+ * Round a size up to a power of two
+ */
+static size_t roundPowerOfTwo(size_t n) {
+    size_t p = 1;
+    while(p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/**
+ * Read the list of randomizations to apply: any of "code", "stack" and
+ * "heap", separated by commas or spaces.  "none" or an empty list turns
+ * all of them off.
+ */
+static void readRandomizations(Config& c) {
+    const char* s = getOption("RANDOMIZE");
+    if(s == NULL) {
+        return;
+    }
+    
+    c.randomizeCode = false;
+    c.randomizeStack = false;
+    c.randomizeHeap = false;
+    
+    while(*s != '\0') {
+        size_t n = strcspn(s, ", ");
+        
+        if(n == 4 && strncmp(s, "code", n) == 0) {
+            c.randomizeCode = true;
+        } else if(n == 5 && strncmp(s, "stack", n) == 0) {
+            c.randomizeStack = true;
+        } else if(n == 4 && strncmp(s, "heap", n) == 0) {
+            c.randomizeHeap = true;
+        } else if(n > 0 && !(n == 4 && strncmp(s, "none", n) == 0)) {
+            fprintf(stderr, "Stabilizer: unknown randomization '%.*s'\n", (int)n, s);
+        }
+        
+        s += n;
+        if(*s != '\0') {
+            s++;
+        }
+    }
+}
+
+static Config* load() {
+    static Config c;
+    
+    c.interval = 500;
+    c.dataShuffle = 256;
+    c.codeShuffle = 256;
+    c.heapClasses = 1;
+    c.codeAlign = CODE_ALIGN;
+    c.stackPadAlign = 16;
+    c.stackPadRange = 256;
+    c.randomizeCode = true;
+    c.randomizeStack = true;
+    c.randomizeHeap = true;
+    
+    readSize("INTERVAL", c.interval, 1);
+    readSize("DATA_SHUFFLE", c.dataShuffle, 1);
+    readSize("CODE_SHUFFLE", c.codeShuffle, 1);
+    readSize("HEAP_CLASSES", c.heapClasses, 1);
+    readSize("CODE_ALIGN", c.codeAlign, 1);
+    readSize("STACK_PAD_ALIGN", c.stackPadAlign, 1);
+    readSize("STACK_PAD_RANGE", c.stackPadRange, 1);
+    readRandomizations(c);
+    
+    // Copies are aligned within pages, and pads must keep the stack aligned
+    c.codeAlign = roundPowerOfTwo(c.codeAlign);
+    if(c.codeAlign > PAGESIZE) {
+        c.codeAlign = PAGESIZE;
+    }
+    c.stackPadAlign = (c.stackPadAlign + 15) & ~(size_t)15;
+    
+    // The data heap splits each doubling into one, two, or four classes
+    if(c.heapClasses > 4) {
+        fprintf(stderr, "Stabilizer: STABILIZER_HEAP_CLASSES is at most 4, using 4\n");
+        c.heapClasses = 4;
+    }
+    c.heapClasses = roundPowerOfTwo(c.heapClasses);
+    
+    return &c;
+}
+
+const Config& getConfig() {
+    static Config* c = load();
+    return *c;
+}
+
+const char* getOption(const char* name) {
+    // The file is read at the first lookup, whenever that is
+    static bool hasFile = readFile();
+    
+    char var[64];
+    snprintf(var, sizeof(var), "STABILIZER_%s", name);
+    
+    const char* value = getenv(var);
+    if(value != NULL) {
+        return value;
+    }
+    
+    // Later lines in the file override earlier ones
+    if(hasFile) {
+        for(size_t i=entryCount; i>0; i--) {
+            if(strcasecmp(entries[i-1].name, name) == 0) {
+                return entries[i-1].value;
+            }
+        }
+    }
+    
+    return NULL;
+}
@@ -0,0 +1,49 @@
+#if !defined(RUNTIME_CONFIG_H)
+#define RUNTIME_CONFIG_H
+
+#include <stddef.h>
+
+/**
+ * Runtime options come from STABILIZER_* environment variables, or from a
+ * file named by STABILIZER_CONFIG with one "NAME = value" line per option.
+ * Names in the file may leave off the STABILIZER_ prefix and are matched
+ * without regard to case; '#' starts a comment.  The environment overrides
+ * the file, so one file can hold a sweep's fixed settings while a driver
+ * script varies the rest.
+ *
+ * The file is read with plain system calls the first time any option is
+ * looked up, which may be before main when module constructors allocate.
+ */
+
+/**
+ * The layout parameters that used to be fixed when the runtime and the
+ * program were built
+ */
+struct Config {
+    size_t interval;        //< Epoch length, in epoch clock ticks (STABILIZER_INTERVAL)
+    size_t dataShuffle;     //< Shuffle buffer size of the data heap (STABILIZER_DATA_SHUFFLE)
+    size_t codeShuffle;     //< Shuffle buffer size of the code heap (STABILIZER_CODE_SHUFFLE)
+    size_t heapClasses;     //< Data heap size classes per doubling of object size (STABILIZER_HEAP_CLASSES)
+    size_t codeAlign;       //< Alignment of relocated functions, in bytes (STABILIZER_CODE_ALIGN)
+    size_t stackPadAlign;   //< Stack pads are multiples of this many bytes (STABILIZER_STACK_PAD_ALIGN)
+    size_t stackPadRange;   //< The number of distinct stack pad sizes (STABILIZER_STACK_PAD_RANGE)
+    
+    /// The randomizations to apply, of those the program was built with (STABILIZER_RANDOMIZE)
+    bool randomizeCode;
+    bool randomizeStack;
+    bool randomizeHeap;
+};
+
+/**
+ * \brief Get the layout parameters, reading them on the first call
+ */
+const Config& getConfig();
+
+/**
+ * \brief Look up an option
+ * \arg name The option's name without the STABILIZER_ prefix, such as "EAGER"
+ * \returns The option's value, or NULL if it is not set
+ */
+const char* getOption(const char* name);
+
+#endif
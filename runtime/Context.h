@@ -39,6 +39,14 @@ public:
         return _frame[1];
     }
     
+    /**
+     * Get the address of the current frame
+     * \returns The current frame pointer
+     */
+    inline void** frame() {
+        return _frame;
+    }
+    
     /**
      * Get the next frame pointer up the stack
      * \returns A reference to the next frame pointer
@@ -0,0 +1,170 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "EpochClock.h"
+#include "PerfCounter.h"
+#include "Threads.h"
+
+enum {
+    InstructionsPerTick = 1000000
+};
+
+static EpochClock current = RealTimeClock;
+
+/// The POSIX timer behind the CPU time clock
+static timer_t cpuTimer;
+
+/// The instruction clock's overflow counters, one per registered thread
+static PerfCounter* instructions[MaxThreads];
+static size_t instructionCount = 0;
+
+/// The calling thread's position in instructions, or -1 if it has no counter
+static __thread ssize_t instructionIndex = -1;
+
+/// Where each counter's thread keeps its instructionIndex
+static ssize_t* instructionOwners[MaxThreads];
+
+/// The period the counters were last armed with, or zero before the first epoch
+static uint64_t instructionPeriod = 0;
+
+static const char* names[] = { "real", "prof", "cpu", "instructions" };
+
+bool parseEpochClock(const char* name, EpochClock& clock) {
+    for(size_t i=0; i<sizeof(names) / sizeof(names[0]); i++) {
+        if(strcmp(name, names[i]) == 0) {
+            clock = (EpochClock)i;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/**
+ * Open a counter of the calling thread's instructions that signals on overflow
+ */
+static bool openInstructionCounter() {
+#if IS_LINUX
+    PerfCounter* c = new PerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, InstructionsPerTick);
+    
+    if(c->isValid() && c->setOverflowSignal(SIGRTMIN)) {
+        instructionIndex = instructionCount;
+        instructionOwners[instructionCount] = &instructionIndex;
+        instructions[instructionCount++] = c;
+        return true;
+    }
+    
+    delete c;
+#endif
+    return false;
+}
+
+/**
+ * Create a one-shot POSIX timer on the process's CPU time
+ */
+static bool initCPUTimeClock() {
+    struct sigevent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_SIGNAL;
+    ev.sigev_signo = SIGRTMIN;
+    
+    return timer_create(CLOCK_PROCESS_CPUTIME_ID, &ev, &cpuTimer) == 0;
+}
+
+EpochClock initEpochClock(EpochClock clock) {
+    if(clock == InstructionClock && !openInstructionCounter()) {
+        fprintf(stderr, "Stabilizer: unable to count instructions on this system, using CPU time\n");
+        clock = CPUTimeClock;
+    }
+    
+    if(clock == CPUTimeClock && !initCPUTimeClock()) {
+        fprintf(stderr, "Stabilizer: unable to create a CPU time timer, using real time\n");
+        clock = RealTimeClock;
+    }
+    
+    current = clock;
+    return current;
+}
+
+void addEpochClockThread() {
+    if(current != InstructionClock) {
+        return;
+    }
+    
+    if(!openInstructionCounter()) {
+        fprintf(stderr, "Stabilizer: unable to count a new thread's instructions\n");
+        
+    } else if(instructionPeriod > 0) {
+        // Join the epoch in progress, so a program whose main thread only waits still ends its epochs
+        instructions[instructionIndex]->arm(instructionPeriod);
+    }
+}
+
+void removeEpochClockThread() {
+    if(instructionIndex < 0) {
+        return;
+    }
+    
+    delete instructions[instructionIndex];
+    
+    // Move the last counter into the gap; its thread finds it by the new index
+    instructionCount--;
+    instructions[instructionIndex] = instructions[instructionCount];
+    instructionOwners[instructionIndex] = instructionOwners[instructionCount];
+    *instructionOwners[instructionIndex] = instructionIndex;
+    
+    instructionIndex = -1;
+}
+
+int getEpochSignal() {
+    switch(current) {
+        case ProfileClock:
+            return SIGPROF;
+        
+        case CPUTimeClock:
+        case InstructionClock:
+            return SIGRTMIN;
+        
+        default:
+            return SIGALRM;
+    }
+}
+
+const char* getEpochClockName() {
+    return names[current];
+}
+
+void armEpochClock(size_t ticks) {
+    if(current == InstructionClock) {
+        instructionPeriod = (uint64_t)ticks * InstructionsPerTick;
+        
+        for(size_t i=0; i<instructionCount; i++) {
+            instructions[i]->arm(instructionPeriod);
+        }
+        return;
+    }
+    
+    struct timespec value;
+    value.tv_sec = ticks / 1000;
+    value.tv_nsec = 1000000 * (ticks % 1000);
+    
+    if(current == CPUTimeClock) {
+        struct itimerspec timer;
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value = value;
+        
+        timer_settime(cpuTimer, 0, &timer, NULL);
+        
+    } else {
+        struct itimerval timer;
+        timer.it_value.tv_sec = value.tv_sec;
+        timer.it_value.tv_usec = value.tv_nsec / 1000;
+        timer.it_interval.tv_sec = 0;
+        timer.it_interval.tv_usec = 0;
+        
+        setitimer(current == ProfileClock ? ITIMER_PROF : ITIMER_REAL, &timer, 0);
+    }
+}
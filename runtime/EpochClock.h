@@ -0,0 +1,67 @@
+#if !defined(RUNTIME_EPOCHCLOCK_H)
+#define RUNTIME_EPOCHCLOCK_H
+
+#include <stddef.h>
+
+/**
+ * The clocks that can end an epoch.  Intervals are counted in ticks: one
+ * millisecond for the time-based clocks, and one million retired user-mode
+ * instructions for the instruction clock.
+ */
+enum EpochClock {
+    RealTimeClock,      //< Wall-clock time, with ITIMER_REAL and SIGALRM
+    ProfileClock,       //< Process user and system time, with ITIMER_PROF and SIGPROF
+    CPUTimeClock,       //< Process CPU time, with a POSIX timer on a real-time signal
+    InstructionClock    //< Instructions retired by any one registered thread, with perf counter overflows
+};
+
+/**
+ * \brief Parse a clock name: "real", "prof", "cpu", or "instructions"
+ * \arg name The name to parse
+ * \arg clock Set to the named clock
+ * \returns false if the name is not recognized
+ */
+bool parseEpochClock(const char* name, EpochClock& clock);
+
+/**
+ * \brief Set up the clock that ends epochs.  Falls back to CPU time if the
+ * instruction counter is unavailable, and to real time if CPU timers are.
+ * Must be called from the main thread before the clock is armed, and before
+ * any other thread is registered.
+ * \arg clock The clock to use
+ * \returns The clock actually in use
+ */
+EpochClock initEpochClock(EpochClock clock);
+
+/**
+ * \brief Count the calling thread's instructions toward the epoch clock, if
+ * it is the instruction clock.  Called with runtimeLock held.
+ */
+void addEpochClockThread();
+
+/**
+ * \brief Stop counting the calling thread's instructions, as it exits.
+ * Called with runtimeLock held.
+ */
+void removeEpochClockThread();
+
+/**
+ * \brief Get the signal the epoch clock delivers
+ */
+int getEpochSignal();
+
+/**
+ * \brief Get the name of the epoch clock in use
+ */
+const char* getEpochClockName();
+
+/**
+ * \brief Deliver the epoch signal once, after a number of ticks.  With the
+ * instruction clock each registered thread counts its own instructions, so
+ * the signal comes when the busiest thread retires the interval, not when
+ * all threads together do.
+ * \arg ticks The interval, in the clock's ticks
+ */
+void armEpochClock(size_t ticks);
+
+#endif
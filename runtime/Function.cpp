@@ -12,58 +12,301 @@ Function::~Function() {
     if(_stackPad != NULL) {
         getDataHeap()->free(_stackPad);
     }
+    
+    if(_stub != NULL) {
+        getCodeHeap()->free(_stub);
+    }
+    
+    if(_prepared != NULL) {
+        freeCode(_prepared);
+    }
+    
+    if(_callees != NULL) {
+        getDataHeap()->free(_callees);
+    }
+    
+    if(_callers != NULL) {
+        getDataHeap()->free(_callers);
+    }
+    
+    if(_sites != NULL) {
+        getDataHeap()->free(_sites);
+    }
 }
 
 /**
- * Copy the code and relocation table for this function.  Use the pre-assembled
- * code/table chunk if the function has already been relocated.
- * 
- * \arg target The destination of the copy.
+ * Move the function's stack pad to a random heap location, so it does not sit
+ * at a fixed offset from the program's globals.  Called from main, before any
+ * copy of the relocation table is made.
  */
-void Function::copyTo(void* target) {
-    if(_current == NULL) {
-        // Copy the code from the original function
-        memcpy(target, _code.base(), _code.size());
-
-        // Patch in the saved header, since the original has been overwritten
-        *(FunctionHeader*)target = _savedHeader;
-
-        // If there is a stack pad table, move it to a random location
-        if(_stackPad != NULL) {
-            uintptr_t* table = (uintptr_t*)_table.base();
-            for(size_t i=0; i<_table.size(); i+=sizeof(uintptr_t)) {
-                if(table[i] == (uintptr_t)_stackPad) {
-                    _stackPad = (uint8_t*)getDataHeap()->malloc(1);
-                    table[i] = (uintptr_t)_stackPad;
-                }
+void Function::moveStackPad() {
+    if(_stackPad != NULL) {
+        uintptr_t* table = (uintptr_t*)_table.base();
+        for(size_t i=0; i<_table.size()/sizeof(uintptr_t); i++) {
+            if(table[i] == (uintptr_t)_stackPad) {
+                _stackPad = (uintptr_t*)getDataHeap()->malloc(sizeof(uintptr_t));
+                table[i] = (uintptr_t)_stackPad;
+                
+                // The pad stays at zero unless stack randomization fills it in
+                *_stackPad = 0;
             }
         }
+    }
+}
 
-        // Copy the relocation table, if needed
-        if(_tableAdjacent) {
-            uint8_t* a = (uint8_t*)target;
-            memcpy(&a[_code.size()], _table.base(), _table.size());
+/**
+ * Assemble a copy of the function from its original code and relocation
+ * table.  This never changes the Function, so it is safe to call from the
+ * pre-copy thread.
+ * 
+ * \arg target The destination of the copy, in the writable alias of the code heap.
+ */
+void Function::copyOriginalTo(void* target) {
+    // Copy the code from the original function
+    memcpy(target, _code.base(), _code.size());
+
+    // Patch in the saved header, since the original has been overwritten
+    *(FunctionHeader*)target = _savedHeader;
+
+    // Copy the relocation table, if needed
+    if(_tableAdjacent) {
+        uint8_t* a = (uint8_t*)target;
+        memcpy(&a[_code.size()], _table.base(), _table.size());
+    }
+    
+    // Keep PC-relative references to other code pointing at the same targets from where the copy runs
+    intptr_t delta = (intptr_t)getCodeRegion()->toExecutable(target) - (intptr_t)_code.base();
+    
+    for(size_t i=0; i<_siteCount; i++) {
+        int32_t* disp = (int32_t*)((uint8_t*)target + _sites[i]);
+        int64_t patched = (int64_t)*disp - delta;
+        
+        if(patched != (int32_t)patched) {
+            ABORT("Copy of %p at %p is out of range of its direct call targets", _code.base(), target);
         }
-    } else {
-        memcpy(target, _current->_memory.base(), getAllocationSize());
+        
+        *disp = (int32_t)patched;
+    }
+}
+
+/**
+ * Record the PC-relative displacements inside this function that must be
+ * patched when it moves.  References into the function itself or its
+ * adjacent relocation table move with the copy, so they are left alone.
+ * 
+ * \arg first The first displacement inside this function, in sorted order
+ * \arg last The end of the displacements
+ */
+void Function::setCallSites(const CodeSite* first, const CodeSite* last) {
+    uintptr_t base = (uintptr_t)_code.base();
+    uintptr_t limit = base + getAllocationSize();
+    
+    _sites = (uint32_t*)getDataHeap()->malloc(sizeof(uint32_t) * (last - first));
+    _siteCount = 0;
+    
+    for(const CodeSite* p = first; p != last; p++) {
+        if(p->target >= base && p->target < limit) {
+            continue;
+        }
+        
+        _sites[_siteCount++] = p->address - base;
     }
 }
 
 /**
- * Create a new FunctionLocation for this Function.
- * \arg relocation The ID for the current relocation phase.
- * \returns Whether or not a new location was created
+ * Allocate and fill in this function's next location ahead of time.  Called
+ * from the pre-copy thread, and only for functions that have already been
+ * relocated once.
+ */
+void Function::prepare() {
+    if(_current != NULL && __atomic_load_n(&_prepared, __ATOMIC_ACQUIRE) == NULL) {
+        void* p = allocateHeapCode(getAllocationSize());
+        
+        if(p != NULL) {
+            copyOriginalTo(p);
+            __atomic_store_n(&_prepared, p, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/**
+ * Create a new FunctionLocation for this Function, using a pre-copied
+ * location if the pre-copy thread has prepared one.
+ * \returns The previous location, or NULL if this is the first relocation
+ * or a sweep has already freed it
  */
 FunctionLocation* Function::relocate() {
     FunctionLocation* oldLocation = _current;
-    _current = new FunctionLocation(this);
+    void* prepared = __atomic_exchange_n(&_prepared, NULL, __ATOMIC_ACQUIRE);
+    
+    _current = new FunctionLocation(this, prepared);
     _current->activate();
+    
+    // Calls into this function may now skip the header, and calls out of the new copy can skip callees' headers
+    _direct = true;
+    linkCalls();
+    linkCallers();
 
-    // Fill the stack pad table with random bytes
-    if(_stackPad != NULL) {
-        // Update random stack pad
-        *_stackPad = getRandomByte();
+    // Pick a new random stack pad, unless stack randomization is off and pads stay at zero
+    if(getConfig().randomizeStack) {
+        randomizeStackPad();
     }
     
     return oldLocation;
 }
+
+/**
+ * Give this function's stack pad a new random size.  Pads from older passes
+ * are a byte that the prologue scales by the 16 byte stack alignment.
+ */
+void Function::randomizeStackPad() {
+    if(_stackPad == NULL) {
+        return;
+    }
+    
+    if(_legacy) {
+        *(uint8_t*)_stackPad = (uint8_t)(getRandomStackPad() / 16);
+    } else {
+        *_stackPad = getRandomStackPad();
+    }
+}
+
+/**
+ * Forward calls to this function to its resolver stub, creating the stub if
+ * this is the first time the function has been sent through the resolver.
+ */
+void Function::setResolver() {
+#if HAS_RESOLVER
+    if(_stub == NULL) {
+        _stub = getCodeHeap()->malloc(sizeof(ResolverStub));
+        
+        if(_stub == NULL) {
+            ABORT("Couldn't allocate memory for resolver stub");
+        }
+        
+        new(_stub) ResolverStub(this, (void*)stabilizer_resolve_trampoline);
+    }
+    
+    forward(getCodeRegion()->toExecutable(_stub));
+    unlinkCalls();
+#else
+    ABORT("Resolver stubs are not supported on this target");
+#endif
+}
+
+/**
+ * Find the registered function behind each direct call slot in the
+ * relocation table.
+ * \arg functions All registered functions, indexed by their original address
+ */
+void Function::findCallees(map<void*, Function*>& functions) {
+    if(_callSlots == 0) {
+        return;
+    }
+    
+    _callees = (Function**)getDataHeap()->malloc(_callSlots * sizeof(Function*));
+    
+    uintptr_t* table = (uintptr_t*)_table.base();
+    for(size_t i=0; i<_callSlots; i++) {
+        map<void*, Function*>::iterator callee = functions.find((void*)table[i]);
+        
+        if(callee != functions.end()) {
+            _callees[i] = callee->second;
+            callee->second->addCaller(this);
+        } else {
+            _callees[i] = NULL;
+        }
+    }
+}
+
+/**
+ * Record a function with a call slot for this one, so its slots can be
+ * updated when this function moves.  Each caller is recorded once.
+ */
+void Function::addCaller(Function* caller) {
+    if(_callerCount > 0 && _callers[_callerCount - 1] == caller) {
+        return;
+    }
+    
+    // Grow the array by doubling, so heavily called functions don't reallocate for every caller
+    if((_callerCount & (_callerCount - 1)) == 0) {
+        size_t capacity = _callerCount == 0 ? 1 : _callerCount * 2;
+        _callers = (Function**)getDataHeap()->realloc(_callers, capacity * sizeof(Function*));
+    }
+    
+    _callers[_callerCount++] = caller;
+}
+
+/**
+ * Get the relocation table used by one of this function's locations, at an
+ * address the runtime can write to
+ */
+uintptr_t* Function::getTable(FunctionLocation* l) {
+    if(_tableAdjacent) {
+        return (uintptr_t*)getCodeRegion()->toWritable(l->_memory.offsetIn(_code.size()));
+    } else {
+        return (uintptr_t*)_table.base();
+    }
+}
+
+/**
+ * Point the current location's call slots straight at the current copy of
+ * each callee that has been relocated this epoch, skipping its forwarding
+ * jump.  Callees that are still waiting to be relocated keep their header.
+ */
+void Function::linkCalls() {
+    if(_callees == NULL || _current == NULL) {
+        return;
+    }
+    
+    uintptr_t* table = getTable(_current);
+    for(size_t i=0; i<_callSlots; i++) {
+        Function* callee = _callees[i];
+        
+        if(callee != NULL && callee->_direct && callee->_current != NULL) {
+            table[i] = (uintptr_t)callee->_current->getBase();
+        }
+    }
+}
+
+/**
+ * Point the call slots of callers already relocated this epoch at this
+ * function's new location.  Without this they would keep calling through
+ * its header until their own next relocation.
+ */
+void Function::linkCallers() {
+    for(size_t i=0; i<_callerCount; i++) {
+        Function* caller = _callers[i];
+        
+        if(!caller->_direct || caller->_current == NULL || caller == this) {
+            continue;
+        }
+        
+        uintptr_t* table = caller->getTable(caller->_current);
+        for(size_t j=0; j<caller->_callSlots; j++) {
+            if(caller->_callees[j] == this) {
+                table[j] = (uintptr_t)_current->getBase();
+            }
+        }
+    }
+}
+
+/**
+ * Point the current location's call slots back at each callee's header.
+ * Called whenever this function is intercepted again, so no location that
+ * outlives its epoch can call a callee's copy after that copy is freed.
+ */
+void Function::unlinkCalls() {
+    _direct = false;
+    
+    if(_callees == NULL || _current == NULL) {
+        return;
+    }
+    
+    uintptr_t* table = getTable(_current);
+    for(size_t i=0; i<_callSlots; i++) {
+        if(_callees[i] != NULL) {
+            table[i] = (uintptr_t)_callees[i]->getCodeBase();
+        }
+    }
+}
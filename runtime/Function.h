@@ -1,6 +1,7 @@
 #if !defined(RUNTIME_FUNCTION_H)
 #define RUNTIME_FUNCTION_H
 
+#include <map>
 #include <string.h>
 #include <sys/mman.h>
 
@@ -13,6 +14,19 @@
 struct Function;
 struct FunctionLocation;
 
+/**
+ * A PC-relative displacement in a function's original code, taken from one
+ * of the relocations the static linker keeps
+ */
+struct CodeSite {
+    uintptr_t address;      //< The address of the 32 bit displacement
+    uintptr_t target;       //< The address the displacement refers to, from the relocation's symbol
+    
+    inline bool operator<(const CodeSite& other) const {
+        return address < other.address;
+    }
+};
+
 struct FunctionHeader {
 private:
     union {
@@ -25,8 +39,24 @@ private:
 public:
     FunctionHeader(Function* f) : _f(f) {}
     
-    void jumpTo(void* target) {
-        new(_jmp) Jump(target);
+    /**
+     * \brief Replace the header with a jump.  Other threads may be running
+     * through the header, so it traps while the jump's tail is written and
+     * the first byte is published last.
+     * \arg target The destination of the jump
+     * \arg site The address the header runs at, when it is written through another alias
+     */
+    void jumpTo(void* target, void* site) {
+        uint8_t jump[sizeof(Jump)];
+        new(jump) Jump(target, site);
+        
+        new(_trap) Trap();
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        
+        memcpy(&_jmp[sizeof(Trap)], &jump[sizeof(Trap)], sizeof(Jump) - sizeof(Trap));
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        
+        memcpy(_jmp, jump, sizeof(Trap));
     }
     
     void trap() {
@@ -44,25 +74,56 @@ private:
     
     MemRange _code;
     MemRange _table;
-    FunctionHeader* _header;
+    FunctionHeader* _header;    //< The header where it runs, in the original code
     FunctionHeader _savedHeader;
     
     bool _tableAdjacent;    //< If true, the relocation table should be placed next to the function
     
-    uint8_t* _stackPad;		//< The address of the stack pad value for this function
+    size_t _callSlots;      //< The number of direct call slots at the start of the relocation table
+    Function** _callees;    //< The registered function called through each call slot, or NULL
+    Function** _callers;    //< The registered functions with a call slot for this one
+    size_t _callerCount;    //< The number of entries in _callers
+    
+    bool _direct;           //< If true, callers may jump straight to the current location
+    
+    uint32_t* _sites;       //< Offsets of PC-relative displacements to patch in each copy
+    size_t _siteCount;      //< The number of entries in _sites
+    
+    uintptr_t* _stackPad;	//< The address of this function's stack pad, in bytes
+    
+    bool _legacy;           //< Registered by an older pass: a one-byte pad in 16 byte units, and no room after the code for a table
+    
+    void* _stub;            //< This function's resolver stub, allocated on first use
+    
+    void* _prepared;        //< A copy for the next relocation, filled in by the pre-copy thread
     
     FunctionLocation* _current;
     
+    size_t _index;          //< This function's position in the runtime's registry
+    
     /**
      * \brief Place a jump instruction to forward calls to this function
      * \arg target The destination of the jump instruction
      */
     inline void forward(void* target) {
-        _header->jumpTo(target);
+        getWritableHeader()->jumpTo(target, _header);
         flush_icache(_header, sizeof(FunctionHeader));
     }
     
-    void copyTo(void* target);
+    /**
+     * \brief Get the address the header is written through.  The runtime
+     * gives the text a writable alias before any header is placed.
+     */
+    inline FunctionHeader* getWritableHeader() {
+        return (FunctionHeader*)getCodeRegion()->toWritable(_header);
+    }
+    
+    void copyOriginalTo(void* target);
+    
+    void addCaller(Function* caller);
+    void linkCallers();
+    
+    uintptr_t* getTable(FunctionLocation* l);
     
 public:
     /**
@@ -87,25 +148,59 @@ public:
     * \arg codeLimit The top of the function
     * \arg tableBase The address of the function's relocation table
     * \arg tableSize The size of the function's relocation table
+    * \arg callSlots The number of direct call slots at the start of the relocation table
     * \arg tableAdjacent If true, the relocation table should be placed immediately after the function
 	* \arg stackPad The address of this function's stack pad size
     */
-    inline Function(void* codeBase, void* codeLimit, void* tableBase, size_t tableSize, bool tableAdjacent, uint8_t* stackPad) :
+    inline Function(void* codeBase, void* codeLimit, void* tableBase, size_t tableSize, size_t callSlots, bool tableAdjacent, uintptr_t* stackPad) :
         _code(codeBase, codeLimit), _table(tableBase, tableSize), _savedHeader(*(FunctionHeader*)_code.base()) {
         
         this->_tableAdjacent = tableAdjacent;
+        this->_callSlots = callSlots;
+        this->_callees = NULL;
+        this->_callers = NULL;
+        this->_callerCount = 0;
+        this->_direct = false;
+        this->_sites = NULL;
+        this->_siteCount = 0;
         this->_stackPad = stackPad;
+        this->_legacy = false;
+        this->_stub = NULL;
+        this->_prepared = NULL;
         this->_current = NULL;
-
-        // Make the function header writable
-        if(mprotect(_code.pageBase(), _code.pageSize(), PROT_READ | PROT_WRITE | PROT_EXEC)) {
-            perror("Unable make code writable");
-            abort();
-        }
+        this->_header = NULL;
+        this->_index = 0;
         
         // Make a copy of the function header
         _savedHeader = *(FunctionHeader*)_code.base();
-        _header = new(_code.base()) FunctionHeader(this);
+    }
+    
+    /**
+     * \brief Replace the start of the original function with its header.
+     * The runtime gives all registered code a writable alias in one pass first.
+     */
+    inline void placeHeader() {
+        _header = (FunctionHeader*)_code.base();
+        new(getWritableHeader()) FunctionHeader(this);
+    }
+    
+    /**
+     * \brief Copy the relocation table into the space reserved for it after
+     * the original code, so the original can run in place.  Only used when
+     * code randomization is off; the table still points at the originals.
+     * \returns false if there is no space for the table, and the function has to be relocated to run
+     */
+    inline bool placeOriginalTable() {
+        if(_tableAdjacent) {
+            // Older passes only reserved a one-byte marker after the code, so the table would overwrite the next function
+            if(_legacy) {
+                return false;
+            }
+            
+            memcpy(getCodeRegion()->toWritable(_code.limit()), _table.base(), _table.size());
+        }
+        
+        return true;
     }
     
     /**
@@ -115,11 +210,40 @@ public:
     
     FunctionLocation* relocate();
     
+    void moveStackPad();
+    void randomizeStackPad();
+    
+    void prepare();
+    
+    void findCallees(std::map<void*, Function*>& functions);
+    void linkCalls();
+    void unlinkCalls();
+    
+    void setCallSites(const CodeSite* first, const CodeSite* last);
+    
     /**
      * \brief Place a trap instruction at the beginning of this function
      */
     inline void setTrap() {
-        _header->trap();
+        getWritableHeader()->trap();
+        unlinkCalls();
+    }
+    
+    /**
+     * \brief Send the next call to this function through its resolver stub
+     */
+    void setResolver();
+    
+    inline size_t getIndex() {
+        return _index;
+    }
+    
+    inline void setIndex(size_t index) {
+        _index = index;
+    }
+    
+    inline MemRange& getCode() {
+        return _code;
     }
     
     inline void* getCodeBase() {
@@ -141,6 +265,22 @@ public:
     inline FunctionLocation* getCurrentLocation() {
         return _current;
     }
+    
+    inline uintptr_t* getStackPad() {
+        return _stackPad;
+    }
+    
+    /**
+     * \brief Mark this function as registered by an older pass, whose stack
+     * pad is a single byte
+     */
+    inline void setLegacy() {
+        _legacy = true;
+    }
+    
+    inline bool isLegacy() {
+        return _legacy;
+    }
 };
 
 #endif
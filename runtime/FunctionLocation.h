@@ -1,9 +1,12 @@
 #if !defined(RUNTIME_FUNCTIONLOCATION_H)
 #define RUNTIME_FUNCTIONLOCATION_H
 
-#include <set>
+#include <vector>
+#include <algorithm>
 
+#include "CodeArena.h"
 #include "MemRange.h"
+#include "MMapAllocator.h"
 #include "Function.h"
 
 using namespace std;
@@ -12,19 +15,88 @@ struct FunctionLocation {
 private:
     friend class Function;
     
+    typedef vector<FunctionLocation*, MMapAllocator<FunctionLocation*> > Registry;
+    
     Function* _f;
     MemRange _memory;
     bool _defunct;
     bool _marked;
     
-    static inline set<FunctionLocation*>& getRegistry() {
-        static set<FunctionLocation*> _registry;
+    /**
+     * \brief Get the registry of all allocated locations.
+     * Locations never overlap, so the registry is kept sorted by base address
+     * and doubles as an interval index for return address lookups.
+     */
+    static inline Registry& getRegistry() {
+        static Registry _registry;
         return _registry;
     }
     
+    /**
+     * \brief Get the free list of preallocated FunctionLocation objects
+     */
+    static inline void*& getPool() {
+        static void* _pool = NULL;
+        return _pool;
+    }
+    
+    /**
+     * \brief Add a fresh slab of objects to the pool
+     * \returns The number of objects added
+     */
+    static size_t refill() {
+        enum { SlabSize = 16 * PAGESIZE };
+        
+        uint8_t* slab = (uint8_t*)mmap(NULL, SlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(slab == MAP_FAILED) {
+            ABORT("Couldn't allocate memory for function locations");
+        }
+        
+        size_t count = SlabSize / sizeof(FunctionLocation);
+        for(size_t i=0; i<count; i++) {
+            operator delete(&slab[i * sizeof(FunctionLocation)]);
+        }
+        
+        return count;
+    }
+    
+    /**
+     * \brief Get the number of code heap bytes held by live locations
+     */
+    static inline size_t& getHeapSize() {
+        static size_t _size = 0;
+        return _size;
+    }
+    
+    /**
+     * \brief Get the largest number of bytes live locations have held at once
+     */
+    static inline size_t& getPeakHeapSize() {
+        static size_t _peak = 0;
+        return _peak;
+    }
+    
+    static inline bool startsBefore(FunctionLocation* l, void* p) {
+        return l->_memory.base() < p;
+    }
+    
+    static inline bool startsAfter(void* p, FunctionLocation* l) {
+        return p < l->_memory.base();
+    }
+    
+    /**
+     * \brief Find the location containing an address with a binary search
+     * \arg p The address to look up
+     * \returns The location containing p, or NULL if p is not in relocated code
+     */
     static FunctionLocation* find(void* p) {
-        for(set<FunctionLocation*>::iterator iter = getRegistry().begin(); iter != getRegistry().end(); iter++) {
-            FunctionLocation* l = *iter;
+        Registry& r = getRegistry();
+        
+        // Find the last location that starts at or below p
+        Registry::iterator iter = upper_bound(r.begin(), r.end(), p, startsAfter);
+        
+        if(iter != r.begin()) {
+            FunctionLocation* l = *(--iter);
             if(l->_memory.contains(p)) {
                 return l;
             }
@@ -34,8 +106,15 @@ private:
     }
     
 public:
-    FunctionLocation(Function* f) :  _f(f), _memory(getCodeHeap()->malloc(_f->getAllocationSize()), _f->getAllocationSize()) {
-        if(_memory.base() == NULL) {
+    /**
+     * \brief Create a new location for a function
+     * \arg f The function being relocated
+     * \arg prepared Writable code heap memory already holding a copy of the function, or NULL to allocate and copy now
+     */
+    FunctionLocation(Function* f, void* prepared = NULL) : _f(f), _memory(NULL, (size_t)0) {
+        void* p = prepared != NULL ? prepared : allocateCode(_f->getAllocationSize());
+        
+        if(p == NULL) {
             perror("code malloc");
             ABORT("Couldn't allocate memory for function relocation");
         }
@@ -43,29 +122,65 @@ public:
         _defunct = false;
         _marked = false;
         
-        _f->copyTo(_memory.base());
+        if(prepared == NULL) {
+            _f->copyOriginalTo(p);
+        }
+        
+        // The copy is written through the heap's writable alias, but runs (and shows up on the stack) at its executable alias
+        _memory = MemRange(getCodeRegion()->toExecutable(p), _f->getAllocationSize());
         
-        getRegistry().insert(this);
+        Registry& r = getRegistry();
+        r.insert(lower_bound(r.begin(), r.end(), _memory.base(), startsBefore), this);
+        
+        getHeapSize() += _memory.size();
+        getPeakHeapSize() = max(getPeakHeapSize(), getHeapSize());
     }
     
     ~FunctionLocation() {
-        getCodeHeap()->free(_memory.base());
+        getHeapSize() -= _memory.size();
+        freeCode(getCodeRegion()->toWritable(_memory.base()));
     }
     
     /**
-     * \brief Allocate FunctionLocation objects on the randomized heap
+     * \brief Allocate FunctionLocation objects from a pool.  Locations are
+     * created in signal handlers, possibly while another thread is stopped
+     * holding a heap lock, so the pool is refilled with mmap instead of a heap.
+     * Only called with the runtime lock held.
      * \arg sz The object size
      */
     void* operator new(size_t sz) {
-        return getDataHeap()->malloc(sz);
+        void*& pool = getPool();
+        
+        if(pool == NULL) {
+            refill();
+        }
+        
+        void* p = pool;
+        pool = *(void**)p;
+        return p;
     }
     
     /**
-     * \brief Free allocated memory to the randomized heap
+     * \brief Return a FunctionLocation object to the pool
      * \arg p The object base pointer
      */
     void operator delete(void* p) {
-        getDataHeap()->free(p);
+        void*& pool = getPool();
+        *(void**)p = pool;
+        pool = p;
+    }
+    
+    /**
+     * \brief Preallocate locations and registry space, so relocating
+     * functions from a handler does not normally allocate
+     * \arg n The number of locations to make room for
+     */
+    static void reserve(size_t n) {
+        getRegistry().reserve(n);
+        
+        while(n > 0) {
+            n -= min(n, refill());
+        }
     }
     
     void activate() {
@@ -80,6 +195,14 @@ public:
         return _memory.base();
     }
     
+    static size_t count() {
+        return getRegistry().size();
+    }
+    
+    static size_t getPeakSize() {
+        return getPeakHeapSize();
+    }
+    
     static void mark(void* p) {
         FunctionLocation* l = find(p);
         if(l != NULL) {
@@ -87,27 +210,81 @@ public:
         }
     }
     
+    /**
+     * \brief Mark every location referred to by a word in a range of memory
+     * \arg base The first word to scan
+     * \arg limit The last word to scan
+     */
+    static void markRange(void** base, void** limit) {
+        for(void** w = base; w <= limit; w++) {
+            mark(*w);
+        }
+    }
+    
+    /**
+     * \brief Point a return address into a defunct location at the same
+     * offset in its function's current location, so the defunct location can
+     * be freed at this sweep.  A return address into a current location just
+     * marks it.  The current location may itself have been released, so it
+     * is marked as well.  If the function has no current location (an
+     * earlier sweep freed it), the defunct location is kept instead.
+     * \arg ret A reference to the return address
+     */
+    static void redirect(void*& ret) {
+        FunctionLocation* l = find(ret);
+        if(l == NULL) {
+            return;
+        }
+        
+        FunctionLocation* current = l->_f->_current;
+        
+        if(l->_defunct && current != NULL && current != l) {
+            ret = l->translate(ret, current->_memory);
+            current->_marked = true;
+        } else {
+            l->_marked = true;
+        }
+    }
+    
+    /**
+     * \brief Free defunct locations that were not marked, compacting the
+     * registry in place so it stays sorted.  A function whose current
+     * location is freed is left with none, so nothing reuses the pointer.
+     */
     static void sweep() {
-        set<FunctionLocation*>::iterator iter = getRegistry().begin();
+        Registry& r = getRegistry();
+        size_t kept = 0;
         
-        while(iter != getRegistry().end()) {
-            FunctionLocation* l = *iter;
+        for(size_t i=0; i<r.size(); i++) {
+            FunctionLocation* l = r[i];
             
             if(l->_defunct && !l->_marked) {
-                getRegistry().erase(iter++);
+                if(l->_f->_current == l) {
+                    l->_f->_current = NULL;
+                }
                 delete l;
             } else {
                 l->_marked = false;
-                iter++;
+                r[kept++] = l;
             }
         }
+        
+        r.resize(kept);
+    }
+    
+    /**
+     * \brief Map an address in this location to the same offset in another copy of the function
+     * \arg p An address in this location
+     * \arg target The other copy
+     */
+    void* translate(void* p, MemRange& target) {
+        return target.offsetIn(_memory.offsetOf(p));
     }
     
     static void* adjust(void* p) {
         FunctionLocation* l = find(p);
         if(l != NULL) {
-            size_t offset = l->_memory.offsetOf(p);
-            return l->_f->_code.offsetIn(offset);
+            return l->translate(p, l->_f->_code);
         } else {
             return p;
         }
@@ -1,13 +1,71 @@
+#include <stdio.h>
+
+#include "Config.h"
 #include "Heap.h"
+#include "ThreadHeap.h"
+
+/// The shuffle buffer sizes a heap can be built with, smallest first
+static const size_t shuffleSizes[] = { 16, 32, 64, 128, 256, 512, 1024 };
+
+/**
+ * Room for a heap of any size on the menu.  Heaps are never freed, and are
+ * placed in static memory because they exist before anything can allocate.
+ */
+template<template<int> class Heap>
+union HeapBuffer {
+    char s16[sizeof(Heap<16>)];
+    char s32[sizeof(Heap<32>)];
+    char s64[sizeof(Heap<64>)];
+    char s128[sizeof(Heap<128>)];
+    char s256[sizeof(Heap<256>)];
+    char s512[sizeof(Heap<512>)];
+    char s1024[sizeof(Heap<1024>)];
+    void* align;
+};
+
+/**
+ * Build a heap with the menu's shuffle size closest to a requested size:
+ * the smallest one at least as large, or the largest one.
+ * \arg buf The memory to build the heap in
+ * \arg shuffle The requested shuffle buffer size
+ * \arg name The heap's name, for warnings
+ */
+template<template<int> class Heap>
+static RandomHeap* makeHeap(HeapBuffer<Heap>* buf, size_t shuffle, const char* name) {
+    size_t count = sizeof(shuffleSizes) / sizeof(shuffleSizes[0]);
+    size_t n = shuffleSizes[count - 1];
+    
+    for(size_t i=0; i<count; i++) {
+        if(shuffleSizes[i] >= shuffle) {
+            n = shuffleSizes[i];
+            break;
+        }
+    }
+    
+    if(n != shuffle) {
+        fprintf(stderr, "Stabilizer: %s heap shuffle size %lu is not supported, using %lu\n",
+            name, (unsigned long)shuffle, (unsigned long)n);
+    }
+    
+    switch(n) {
+        case 16: return new(buf) Heap<16>;
+        case 32: return new(buf) Heap<32>;
+        case 64: return new(buf) Heap<64>;
+        case 128: return new(buf) Heap<128>;
+        case 256: return new(buf) Heap<256>;
+        case 512: return new(buf) Heap<512>;
+        default: return new(buf) Heap<1024>;
+    }
+}
 
-DataHeapType* getDataHeap() {
-    static char buf[sizeof(DataHeapType)];
-    static DataHeapType* _theDataHeap = new (buf) DataHeapType;
+RandomHeap* getDataHeap() {
+    static HeapBuffer<ThreadedHeap> buf;
+    static RandomHeap* _theDataHeap = makeHeap(&buf, getConfig().dataShuffle, "data");
     return _theDataHeap;
 }
 
-CodeHeapType* getCodeHeap() {
-    static char buf[sizeof(CodeHeapType)];
-    static CodeHeapType* _theCodeHeap = new (buf) CodeHeapType;
+RandomHeap* getCodeHeap() {
+    static HeapBuffer<CodeHeap> buf;
+    static RandomHeap* _theCodeHeap = makeHeap(&buf, getConfig().codeShuffle, "code");
     return _theCodeHeap;
 }
@@ -5,27 +5,89 @@
 #include <shuffleheap.h>
 
 #include "Util.h"
-#include "MMapSource.h"
+#include "CodeRegion.h"
 
 enum {
-    DataShuffle = 256,
-    DataProt = PROT_READ | PROT_WRITE,
-    DataFlags = MAP_PRIVATE | MAP_ANONYMOUS,
-    DataSize = 0x2000000,
-    
-    CodeShuffle = 256,
     CodeProt = PROT_READ | PROT_WRITE | PROT_EXEC,
     CodeFlags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
     CodeSize = 0x2000000
 };
 
-class DataSource : public SizeHeap<FreelistHeap<BumpAlloc<DataSize, MMapSource<DataProt, DataFlags>, 16> > > {};
-class CodeSource : public SizeHeap<FreelistHeap<BumpAlloc<CodeSize, MMapSource<CodeProt, CodeFlags>, CODE_ALIGN> > > {};
+// Relocated code is aligned to the configured boundary by allocateCode, on top of the heap
+class CodeSource : public SizeHeap<FreelistHeap<BumpAlloc<CodeSize, CodeRegionSource<CodeProt, CodeFlags>, 16> > > {};
+
+/**
+ * The interface to a randomized heap.  The shuffle buffer size is a template
+ * parameter, so each heap is instantiated for every size on a fixed menu and
+ * the configured one is picked when the heap is first used.
+ */
+class RandomHeap {
+public:
+    virtual void* malloc(size_t sz) = 0;
+    virtual void free(void* p) = 0;
+    virtual void* calloc(size_t n, size_t sz) = 0;
+    virtual void* realloc(void* p, size_t sz) = 0;
+    virtual size_t getSize(void* p) = 0;
+    
+    /**
+     * \brief Allocate an object aligned to a power of two
+     * \returns The object, or NULL if the heap cannot meet the alignment
+     */
+    virtual void* memalign(size_t align, size_t sz) = 0;
+};
+
+/**
+ * A randomized heap with a shuffle buffer of Shuffle objects per size class.
+ * It is locked because the pre-copy thread allocates from the code heap.
+ */
+template<int Shuffle, class Source>
+class ShuffledHeap : public RandomHeap {
+private:
+    ANSIWrapper<LockedHeap<PosixLockType, KingsleyHeap<ShuffleHeap<Shuffle, Source>, Source> > > _heap;
+    
+public:
+    void* malloc(size_t sz) {
+        return _heap.malloc(sz);
+    }
+    
+    void free(void* p) {
+        _heap.free(p);
+    }
     
-typedef ANSIWrapper<KingsleyHeap<ShuffleHeap<DataShuffle, DataSource>, DataSource> > DataHeapType;
-typedef ANSIWrapper<KingsleyHeap<ShuffleHeap<CodeShuffle, CodeSource>, CodeSource> > CodeHeapType;
+    void* calloc(size_t n, size_t sz) {
+        return _heap.calloc(n, sz);
+    }
     
-DataHeapType* getDataHeap();
-CodeHeapType* getCodeHeap();
+    void* realloc(void* p, size_t sz) {
+        return _heap.realloc(p, sz);
+    }
+    
+    size_t getSize(void* p) {
+        return _heap.getSize(p);
+    }
+    
+    /**
+     * Only code is allocated here, and it is aligned by its callers, so this
+     * heap never promises more than malloc does
+     */
+    void* memalign(size_t align, size_t sz) {
+        return align <= 16 ? _heap.malloc(sz) : NULL;
+    }
+};
+
+template<int Shuffle>
+class CodeHeap : public ShuffledHeap<Shuffle, CodeSource> {};
+
+/**
+ * \brief Get the randomized heap for the runtime's and the program's data,
+ * shuffled as set by STABILIZER_DATA_SHUFFLE
+ */
+RandomHeap* getDataHeap();
+
+/**
+ * \brief Get the randomized heap relocated code falls back to, shuffled as
+ * set by STABILIZER_CODE_SHUFFLE
+ */
+RandomHeap* getCodeHeap();
 
 #endif
@@ -2,6 +2,7 @@
 #define RUNTIME_JUMP_H
 
 #include <new>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "Arch.h"
@@ -11,9 +12,18 @@ struct X86Jump32 {
     volatile uint8_t jmp_opcode;
     volatile uint32_t jmp_offset;
 
-    X86Jump32(void *target) {
+    /**
+     * \brief Encode a jump
+     * \arg target The destination of the jump
+     * \arg site The address the jump will run at, if it is being built somewhere else
+     */
+    X86Jump32(void *target, void* site = NULL) {
+        if(site == NULL) {
+            site = this;
+        }
+        
         jmp_opcode = 0xE9;
-        jmp_offset = (uint32_t)((intptr_t)target - (intptr_t)this) - sizeof(struct X86Jump32);
+        jmp_offset = (uint32_t)((intptr_t)target - (intptr_t)site) - sizeof(struct X86Jump32);
     }
 
 } __attribute__((packed));
@@ -26,7 +36,7 @@ struct X86Jump64 {
     volatile uint32_t target_high;
     volatile uint8_t retq;
 
-    X86Jump64(void *target) {
+    X86Jump64(void *target, void* site = NULL) {
         /* x86_64 doesn't have an immediate 64 bit jump, so build one:
          *  1. Move down 8 bytes on the stack
          *  2. Put the target address on the stack in 32 bit chunks
@@ -47,13 +57,28 @@ struct X86_64Jump {
         uint8_t jmp64[sizeof(X86Jump64)];
     };
     
-    X86_64Jump(void *target) {
-        if((uintptr_t)target - (uintptr_t)this <= 0x00000000FFFFFFFFu || (uintptr_t)this - (uintptr_t)target <= 0x00000000FFFFFFFFu) {
-            new(this) X86Jump32(target);
+    X86_64Jump(void *target, void* site = NULL) {
+        if(site == NULL) {
+            site = this;
+        }
+        
+        intptr_t offset = (intptr_t)target - (intptr_t)site - sizeof(X86Jump32);
+        
+        if(offset == (int32_t)offset) {
+            new(this) X86Jump32(target, site);
         } else {
             new(this) X86Jump64(target);
+            __atomic_add_fetch(&farJumps(), 1, __ATOMIC_RELAXED);
         }
     }
+    
+    /**
+     * \brief The number of jumps that were out of rel32 range and used the slow push/ret sequence
+     */
+    static size_t& farJumps() {
+        static size_t _farJumps = 0;
+        return _farJumps;
+    }
 } __attribute__((packed));
 
 struct PPCJump {
@@ -67,7 +92,7 @@ struct PPCJump {
         };
     } __attribute__((packed));
 
-    PPCJump(void *target) {
+    PPCJump(void *target, void* site = NULL) {
         uintptr_t t = (uintptr_t)target;
         uintptr_t pos_offset = t - (uintptr_t)this;
         intptr_t neg_offset = (intptr_t)this - (intptr_t)t;
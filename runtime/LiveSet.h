@@ -0,0 +1,98 @@
+#if !defined(RUNTIME_LIVESET_H)
+#define RUNTIME_LIVESET_H
+
+#include <string.h>
+
+#include "Debug.h"
+#include "Function.h"
+#include "Heap.h"
+
+/**
+ * The set of functions relocated in the current epoch.  Membership is a
+ * bitset indexed by each Function's registry index, and members are also
+ * kept in a dense list so epoch boundaries scan only the live functions.
+ * All storage is allocated up front, so inserting and clearing are safe in
+ * signal handlers.
+ */
+struct LiveSet {
+private:
+    enum { WordBits = sizeof(uintptr_t) * 8 };
+    
+    uintptr_t* _bits;
+    Function** _list;
+    size_t _count;
+    size_t _capacity;
+    
+public:
+    LiveSet() {
+        _bits = NULL;
+        _list = NULL;
+        _count = 0;
+        _capacity = 0;
+    }
+    
+    /**
+     * \brief Allocate space for every registered function.  Called once all
+     * functions are registered, before any handler can run.
+     * \arg n The number of registered functions
+     */
+    void reserve(size_t n) {
+        // With nothing registered nothing can be inserted, and an empty allocation may come back NULL
+        if(n == 0) {
+            return;
+        }
+        
+        size_t words = (n + WordBits - 1) / WordBits;
+        
+        _bits = (uintptr_t*)getDataHeap()->malloc(words * sizeof(uintptr_t));
+        _list = (Function**)getDataHeap()->malloc(n * sizeof(Function*));
+        
+        if(_bits == NULL || _list == NULL) {
+            ABORT("Couldn't allocate the live function set");
+        }
+        
+        memset(_bits, 0, words * sizeof(uintptr_t));
+        _capacity = n;
+    }
+    
+    inline bool contains(Function* f) {
+        size_t i = f->getIndex();
+        return (_bits[i / WordBits] >> (i % WordBits)) & 1;
+    }
+    
+    inline void insert(Function* f) {
+        size_t i = f->getIndex();
+        _bits[i / WordBits] |= (uintptr_t)1 << (i % WordBits);
+        _list[_count++] = f;
+    }
+    
+    /**
+     * \brief Empty the set, touching only the bits of its members
+     */
+    inline void clear() {
+        for(size_t n=0; n<_count; n++) {
+            size_t i = _list[n]->getIndex();
+            _bits[i / WordBits] &= ~((uintptr_t)1 << (i % WordBits));
+        }
+        _count = 0;
+    }
+    
+    /**
+     * \brief Exchange contents with another set of the same capacity
+     */
+    inline void swap(LiveSet& other) {
+        LiveSet tmp = *this;
+        *this = other;
+        other = tmp;
+    }
+    
+    inline size_t size() {
+        return _count;
+    }
+    
+    inline Function* operator[](size_t n) {
+        return _list[n];
+    }
+};
+
+#endif
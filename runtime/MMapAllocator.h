@@ -0,0 +1,42 @@
+#if !defined(RUNTIME_MMAPALLOCATOR_H)
+#define RUNTIME_MMAPALLOCATOR_H
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "Debug.h"
+#include "Util.h"
+
+/**
+ * A standard allocator that maps memory directly.  Containers that grow in
+ * signal handlers use it, since a stopped thread may hold a heap's lock.
+ */
+template<typename T> struct MMapAllocator {
+    typedef T value_type;
+    
+    MMapAllocator() {}
+    template<typename U> MMapAllocator(const MMapAllocator<U>&) {}
+    
+    T* allocate(size_t n) {
+        void* p = mmap(NULL, roundUp(n * sizeof(T)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        
+        if(p == MAP_FAILED) {
+            ABORT("Couldn't map memory for runtime metadata");
+        }
+        
+        return (T*)p;
+    }
+    
+    void deallocate(T* p, size_t n) {
+        munmap(p, roundUp(n * sizeof(T)));
+    }
+    
+    static size_t roundUp(size_t sz) {
+        return (sz + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1);
+    }
+};
+
+template<typename T, typename U> bool operator==(const MMapAllocator<T>&, const MMapAllocator<U>&) { return true; }
+template<typename T, typename U> bool operator!=(const MMapAllocator<T>&, const MMapAllocator<U>&) { return false; }
+
+#endif
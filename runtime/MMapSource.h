@@ -3,6 +3,55 @@
 
 #include "Util.h"
 
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0
+#endif
+
+enum HugePageMode {
+    HugePagesOff,       //< Use ordinary pages
+    HugePagesAdvise,    //< Ask for transparent huge pages with madvise
+    HugePagesMapped     //< Map from the hugetlbfs pool, advising if the pool is empty
+};
+
+/**
+ * \brief Back an existing page-aligned mapping with 2MB pages.  Only the
+ * 2MB-aligned part of the range is affected.
+ * \arg p The base of the mapping
+ * \arg sz The size of the mapping
+ * \arg prot The protection of the mapping
+ * \arg flags The flags the mapping was created with
+ * \arg mode How to get huge pages
+ * \returns false if the range could not be backed by huge pages
+ */
+static inline bool useHugePages(void* p, size_t sz, int prot, int flags, HugePageMode mode) {
+    uintptr_t base = ((uintptr_t)p + HUGEPAGESIZE - 1) & ~(uintptr_t)(HUGEPAGESIZE - 1);
+    uintptr_t limit = ((uintptr_t)p + sz) & ~(uintptr_t)(HUGEPAGESIZE - 1);
+    
+    if(mode == HugePagesOff || limit <= base) {
+        return false;
+    }
+    
+#if defined(MREMAP_FIXED)
+    if(mode == HugePagesMapped && MAP_HUGETLB != 0) {
+        // Map the huge pages elsewhere first, so a short pool leaves the original mapping intact
+        void* q = mmap(NULL, limit - base, prot, (flags & ~MAP_32BIT) | MAP_HUGETLB, -1, 0);
+        
+        if(q != MAP_FAILED) {
+            if(mremap(q, limit - base, limit - base, MREMAP_MAYMOVE | MREMAP_FIXED, (void*)base) == (void*)base) {
+                return true;
+            }
+            munmap(q, limit - base);
+        }
+    }
+#endif
+    
+#if defined(MADV_HUGEPAGE)
+    return madvise((void*)base, limit - base, MADV_HUGEPAGE) == 0;
+#else
+    return false;
+#endif
+}
+
 template<int Prot, int Flags> class MMapSource {
 private:
     bool _exhausted32;
@@ -15,6 +64,15 @@ public:
     }
     
     inline void* malloc(size_t sz) {
+        return malloc(sz, HugePagesOff);
+    }
+    
+    /**
+     * \brief Map new memory, optionally backed by huge pages
+     * \arg sz The size of the mapping
+     * \arg huge How to get huge pages for the mapping
+     */
+    inline void* malloc(size_t sz, HugePageMode huge) {
         void* ptr;
         
         if(Flags & MAP_32BIT) {
@@ -23,6 +81,7 @@ public:
                 ptr = mmap(NULL, sz, Prot, Flags, -1, 0);
                 
                 if(ptr != MAP_FAILED) {
+                    useHugePages(ptr, sz, Prot, Flags, huge);
                     return ptr;
                 } else {
                     _exhausted32 = true;
@@ -35,6 +94,8 @@ public:
         
         if(ptr == MAP_FAILED) {
             ptr = NULL;
+        } else {
+            useHugePages(ptr, sz, Prot, Flags, huge);
         }
         
         return ptr;
@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "Debug.h"
+#include "PageMap.h"
+
+PageInfo* pageMapRoot[1 << RootBits];
+
+/**
+ * Get the leaf that covers a page, making it if it does not exist yet.  Two
+ * threads can race to make the same leaf; the loser unmaps its copy.
+ */
+static PageInfo* getLeaf(uintptr_t page) {
+    PageInfo** slot = &pageMapRoot[page >> LeafBits];
+    
+    PageInfo* leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if(leaf != NULL) {
+        return leaf;
+    }
+    
+    size_t sz = sizeof(PageInfo) << LeafBits;
+    void* p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        ABORT("Couldn't allocate a page map leaf");
+    }
+    
+    if(__atomic_compare_exchange_n(slot, &leaf, (PageInfo*)p, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return (PageInfo*)p;
+    }
+    
+    munmap(p, sz);
+    return leaf;
+}
+
+void setPages(void* p, size_t sz, SpanHeap* owner, size_t size) {
+    uintptr_t first = (uintptr_t)p >> PageShift;
+    uintptr_t last = first + (sz >> PageShift);
+    
+    for(uintptr_t page = first; page < last; page++) {
+        PageInfo& info = getLeaf(page)[page & ((1 << LeafBits) - 1)];
+        info.owner = owner;
+        info.size = size;
+    }
+}
+
+void clearPages(void* p, size_t sz) {
+    uintptr_t first = (uintptr_t)p >> PageShift;
+    uintptr_t last = first + (sz >> PageShift);
+    
+    for(uintptr_t page = first; page < last; page++) {
+        PageInfo* leaf = __atomic_load_n(&pageMapRoot[page >> LeafBits], __ATOMIC_ACQUIRE);
+        if(leaf != NULL) {
+            leaf[page & ((1 << LeafBits) - 1)].size = 0;
+        }
+    }
+}
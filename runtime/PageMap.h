@@ -0,0 +1,62 @@
+#if !defined(RUNTIME_PAGEMAP_H)
+#define RUNTIME_PAGEMAP_H
+
+#include "Util.h"
+
+class SpanHeap;
+
+/**
+ * What the data heap knows about one page it owns
+ */
+struct PageInfo {
+    SpanHeap* owner;    //< The heap whose objects fill the page, or NULL for a large object
+    size_t size;        //< The size of each object on the page, or the large object's usable size
+};
+
+enum {
+    PageShift = 12,
+    AddressBits = sizeof(void*) == 8 ? 48 : 32,
+    
+    /// The page map is a two-level radix tree over every page in the address space
+    LeafBits = (AddressBits - PageShift) / 2,
+    RootBits = AddressBits - PageShift - LeafBits
+};
+
+/// The page map's root.  Leaves are allocated as pages in their range are handed out.
+extern PageInfo* pageMapRoot[1 << RootBits];
+
+/**
+ * \brief Look up a page the data heap owns
+ * \arg p Any address on the page
+ * \returns The page's entry, or NULL if the data heap does not own it
+ */
+static inline PageInfo* findPage(void* p) {
+    uintptr_t page = (uintptr_t)p >> PageShift;
+    if(page >> (RootBits + LeafBits) != 0) {
+        return NULL;
+    }
+    
+    PageInfo* leaf = __atomic_load_n(&pageMapRoot[page >> LeafBits], __ATOMIC_ACQUIRE);
+    if(leaf == NULL) {
+        return NULL;
+    }
+    
+    PageInfo* info = &leaf[page & ((1 << LeafBits) - 1)];
+    return info->size == 0 ? NULL : info;
+}
+
+/**
+ * \brief Record that the data heap owns a range of pages
+ * \arg p The first page
+ * \arg sz The size of the range, a multiple of the page size
+ * \arg owner The heap whose objects fill the pages, or NULL for a large object
+ * \arg size The size of each object, or the large object's usable size
+ */
+void setPages(void* p, size_t sz, SpanHeap* owner, size_t size);
+
+/**
+ * \brief Record that the data heap no longer owns a range of pages
+ */
+void clearPages(void* p, size_t sz);
+
+#endif
@@ -0,0 +1,156 @@
+#if !defined(RUNTIME_PERFCOUNTER_H)
+#define RUNTIME_PERFCOUNTER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Arch.h"
+
+#if IS_LINUX
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * A hardware event counter for this process and the threads it creates,
+ * counting user-mode events only.  A sampling counter instead counts the
+ * calling thread, and signals the process when it overflows.
+ */
+struct PerfCounter {
+private:
+    int _fd;
+    
+public:
+    /**
+     * \brief Open a counter.  A counting counter starts immediately; a
+     * sampling counter waits to be armed.
+     * \arg type The perf event type, such as PERF_TYPE_HW_CACHE
+     * \arg config The event, in the encoding for its type
+     * \arg period If nonzero, sample every period events instead of counting
+     */
+    PerfCounter(uint32_t type, uint64_t config, uint64_t period = 0) {
+        _fd = -1;
+        
+#if IS_LINUX
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        
+        if(period == 0) {
+            attr.inherit = 1;
+        } else {
+            attr.sample_period = period;
+            attr.disabled = 1;
+            attr.wakeup_events = 1;
+        }
+        
+        _fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    
+    ~PerfCounter() {
+        if(_fd != -1) {
+            close(_fd);
+        }
+    }
+    
+    /**
+     * \brief Check if the counter could be opened.  It will not be if the
+     * hardware lacks the event or perf_event_paranoid forbids it.
+     */
+    inline bool isValid() {
+        return _fd != -1;
+    }
+    
+    /**
+     * \brief Read the current count, or zero if the counter is not valid
+     */
+    inline uint64_t read() {
+        uint64_t count = 0;
+        
+        if(_fd == -1 || ::read(_fd, &count, sizeof(count)) != sizeof(count)) {
+            return 0;
+        }
+        
+        return count;
+    }
+    
+#if IS_LINUX
+    /**
+     * \brief Send a signal to this process when a sampling counter overflows
+     * \arg sig The signal to send
+     * \returns true if the signal was set up
+     */
+    bool setOverflowSignal(int sig) {
+        struct f_owner_ex owner;
+        owner.type = F_OWNER_PID;
+        owner.pid = getpid();
+        
+        return _fd != -1
+            && fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_ASYNC) == 0
+            && fcntl(_fd, F_SETSIG, sig) == 0
+            && fcntl(_fd, F_SETOWN_EX, &owner) == 0;
+    }
+    
+    /**
+     * \brief Restart a sampling counter from zero, so it signals once after
+     * period more events and then disables itself
+     * \arg period The number of events until the signal
+     */
+    void arm(uint64_t period) {
+        if(_fd != -1) {
+            ioctl(_fd, PERF_EVENT_IOC_PERIOD, &period);
+            ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(_fd, PERF_EVENT_IOC_REFRESH, 1);
+        }
+    }
+    
+    /**
+     * \brief Create a counter for instruction TLB misses
+     */
+    static PerfCounter* iTLBMisses() {
+        return new PerfCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    }
+    
+    /**
+     * \brief Create a counter for level 1 data cache read misses
+     */
+    static PerfCounter* l1dMisses() {
+        return new PerfCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    }
+    
+    /**
+     * \brief Create a counter for last level cache read misses
+     */
+    static PerfCounter* llcMisses() {
+        return new PerfCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    }
+#else
+    static PerfCounter* iTLBMisses() {
+        return new PerfCounter(0, 0);
+    }
+    
+    static PerfCounter* l1dMisses() {
+        return new PerfCounter(0, 0);
+    }
+    
+    static PerfCounter* llcMisses() {
+        return new PerfCounter(0, 0);
+    }
+#endif
+};
+
+#endif
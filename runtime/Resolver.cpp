@@ -0,0 +1,140 @@
+/**
+ * Trampoline for signal-free lazy relocation.
+ *
+ * A function's resolver stub loads its Function* into r11 and jumps here with
+ * the program's arguments still in registers and the caller's return address
+ * on top of the stack.  The trampoline builds a normal frame, saves every
+ * argument register, calls stabilizer_resolve() to relocate the function, then
+ * restores the arguments and tail-jumps to the new copy.
+ *
+ * The runtime is ordinary compiled code, and memcpy and friends may use the
+ * full width of the vector registers, so the trapped function's __m256 and
+ * __m512 arguments are saved with xsave, as glibc's _dl_runtime_resolve_xsave
+ * does.  Processors without xsave have no registers wider than xmm, and use
+ * fxsave instead.
+ */
+
+#include <stddef.h>
+
+#include "Arch.h"
+
+#if IS_X86_64
+
+#include <cpuid.h>
+
+/**
+ * Find the size of the xsave area for the state components the OS has
+ * enabled, or zero if xsave is not available
+ */
+static size_t getXsaveSize() {
+    unsigned int eax, ebx, ecx, edx;
+    
+    // CPUID.1:ECX.OSXSAVE says the OS has enabled xsave and set XCR0
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)) {
+        return 0;
+    }
+    
+    // CPUID.(EAX=0DH,ECX=0):EBX is the standard format size for the features enabled in XCR0
+    __cpuid_count(0xD, 0, eax, ebx, ecx, edx);
+    return ebx;
+}
+
+extern "C" {
+    /// The trampoline's vector save area size, read from assembly; zero selects fxsave
+    __attribute__((visibility("hidden"))) size_t stabilizer_xsave_size = getXsaveSize();
+}
+
+#if IS_OSX
+#	define SYMBOL(x) "_" #x
+#	define CALL(x) "_" #x
+#else
+#	define SYMBOL(x) #x
+#	define CALL(x) #x "@PLT"
+#endif
+
+/// The xsave components the trampoline saves: SSE, AVX, opmask, ZMM_Hi256, and Hi16_ZMM
+#define XSAVE_MASK "0xe6"
+
+asm(
+    ".text\n"
+    ".globl " SYMBOL(stabilizer_resolve_trampoline) "\n"
+    SYMBOL(stabilizer_resolve_trampoline) ":\n"
+    
+    // Link a frame so stack walks from the runtime reach the caller
+    "    push %rbp\n"
+    "    mov %rsp, %rbp\n"
+    
+    // Save integer argument registers, the vararg count in rax, and the static chain in r10
+    "    push %rax\n"
+    "    push %rdi\n"
+    "    push %rsi\n"
+    "    push %rdx\n"
+    "    push %rcx\n"
+    "    push %r8\n"
+    "    push %r9\n"
+    "    push %r10\n"
+    
+    // Save the vector state in a 64-byte aligned area below the integer registers
+    "    mov " SYMBOL(stabilizer_xsave_size) "(%rip), %rcx\n"
+    "    test %rcx, %rcx\n"
+    "    jz 1f\n"
+    "    sub %rcx, %rsp\n"
+    "    and $-64, %rsp\n"
+    
+    // xrstor faults unless the rest of the xsave header is zero
+    "    xor %eax, %eax\n"
+    "    mov %rax, 512(%rsp)\n"
+    "    mov %rax, 520(%rsp)\n"
+    "    mov %rax, 528(%rsp)\n"
+    "    mov %rax, 536(%rsp)\n"
+    "    mov %rax, 544(%rsp)\n"
+    "    mov %rax, 552(%rsp)\n"
+    "    mov %rax, 560(%rsp)\n"
+    "    mov %rax, 568(%rsp)\n"
+    
+    // SSE, AVX, and the AVX-512 mask and upper registers
+    "    mov $" XSAVE_MASK ", %eax\n"
+    "    xor %edx, %edx\n"
+    "    xsave (%rsp)\n"
+    "    jmp 2f\n"
+    
+    "1:\n"
+    "    sub $512, %rsp\n"
+    "    and $-64, %rsp\n"
+    "    fxsave (%rsp)\n"
+    
+    // Relocate the function; the new code address comes back in rax
+    "2:\n"
+    "    mov %r11, %rdi\n"
+    "    call " CALL(stabilizer_resolve) "\n"
+    "    mov %rax, %r11\n"
+    
+    "    cmpq $0, " SYMBOL(stabilizer_xsave_size) "(%rip)\n"
+    "    jz 3f\n"
+    "    mov $" XSAVE_MASK ", %eax\n"
+    "    xor %edx, %edx\n"
+    "    xrstor (%rsp)\n"
+    "    jmp 4f\n"
+    
+    "3:\n"
+    "    fxrstor (%rsp)\n"
+    
+    // Drop the save area, back to the integer registers
+    "4:\n"
+    "    lea -64(%rbp), %rsp\n"
+    
+    "    pop %r10\n"
+    "    pop %r9\n"
+    "    pop %r8\n"
+    "    pop %rcx\n"
+    "    pop %rdx\n"
+    "    pop %rsi\n"
+    "    pop %rdi\n"
+    "    pop %rax\n"
+    "    pop %rbp\n"
+    
+    // Enter the relocated function as if it had been called directly
+    "    jmp *%r11\n"
+);
+
+#endif
@@ -0,0 +1,218 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "Config.h"
+#include "Debug.h"
+#include "ThreadHeap.h"
+#include "Threads.h"
+
+/// The calling thread's heap
+static __thread SpanHeap* current __attribute__((tls_model("initial-exec"))) = NULL;
+
+/// Heaps left by threads that have exited, waiting for a new thread
+static SpinLock idleLock;
+static SpanHeap* idle[256];
+static size_t idleCount = 0;
+
+/// Hands a thread's heap to the idle list when the thread exits
+static pthread_key_t exitKey;
+static pthread_once_t exitKeyOnce = PTHREAD_ONCE_INIT;
+
+static size_t nextShard = 0;
+
+SpanHeap::SpanHeap(size_t shard) {
+    memset(_chunks, 0, sizeof(_chunks));
+    _remote = NULL;
+    _shard = shard;
+    _classBits = __builtin_ctzl(getConfig().heapClasses);
+}
+
+/**
+ * Take a fresh chunk for a size class and put it at the front of the class's list
+ */
+Chunk* SpanHeap::newChunk(size_t sizeClass) {
+    Chunk* k = (Chunk*)allocateChunks(1, _shard);
+    if(k == NULL) {
+        return NULL;
+    }
+    
+    k->sizeClass = sizeClass;
+    k->size = getClassSize(sizeClass, _classBits);
+    setPages(k, ChunkSize, this, k->size);
+    
+    // Objects start past the header on the largest power of two dividing their size, so they all share that alignment
+    size_t align = k->size & -k->size;
+    
+    k->free = NULL;
+    k->bump = (uintptr_t)k + (align > ChunkHeaderSize ? align : ChunkHeaderSize);
+    k->limit = (uintptr_t)k + ChunkSize;
+    k->live = 0;
+    k->listed = true;
+    k->prev = NULL;
+    k->next = _chunks[sizeClass];
+    
+    if(k->next != NULL) {
+        k->next->prev = k;
+    }
+    _chunks[sizeClass] = k;
+    
+    return k;
+}
+
+/**
+ * Remove a chunk from its class's list of chunks with room
+ */
+void SpanHeap::unlink(Chunk* k) {
+    if(k->prev != NULL) {
+        k->prev->next = k->next;
+    } else {
+        _chunks[k->sizeClass] = k->next;
+    }
+    
+    if(k->next != NULL) {
+        k->next->prev = k->prev;
+    }
+    
+    k->listed = false;
+}
+
+void* SpanHeap::allocate(size_t sizeClass) {
+    Chunk* k = _chunks[sizeClass];
+    
+    while(true) {
+        if(k == NULL) {
+            k = newChunk(sizeClass);
+            if(k == NULL) {
+                return NULL;
+            }
+        }
+        
+        void* p = k->free;
+        if(p != NULL) {
+            k->free = *(void**)p;
+            k->live++;
+            return p;
+        }
+        
+        if(k->bump + k->size <= k->limit) {
+            p = (void*)k->bump;
+            k->bump += k->size;
+            k->live++;
+            return p;
+        }
+        
+        // The chunk is full, so it leaves the list until an object comes back
+        unlink(k);
+        k = _chunks[sizeClass];
+    }
+}
+
+void SpanHeap::release(void* p) {
+    Chunk* k = (Chunk*)getChunk(p);
+    
+    *(void**)p = k->free;
+    k->free = p;
+    k->live--;
+    
+    if(!k->listed) {
+        k->listed = true;
+        k->prev = NULL;
+        k->next = _chunks[k->sizeClass];
+        if(k->next != NULL) {
+            k->next->prev = k;
+        }
+        _chunks[k->sizeClass] = k;
+    }
+    
+    // Keep the class's last chunk, so a class that empties and refills does not churn chunks
+    if(k->live == 0 && (k->prev != NULL || k->next != NULL)) {
+        unlink(k);
+        clearPages(k, ChunkSize);
+        freeChunks(k, 1, _shard);
+    }
+}
+
+/**
+ * Park an exiting thread's heap for the next new thread.  Objects other
+ * threads free meanwhile wait in its queue.
+ */
+static void detach(void* h) {
+    current = NULL;
+    
+    idleLock.lock();
+    if(idleCount < sizeof(idle) / sizeof(idle[0])) {
+        idle[idleCount++] = (SpanHeap*)h;
+    }
+    idleLock.unlock();
+}
+
+static void makeExitKey() {
+    pthread_key_create(&exitKey, detach);
+}
+
+SpanHeap* getThreadHeap() {
+    return current;
+}
+
+SpanHeap* attachThreadHeap(SpanHeap* (*create)(size_t shard)) {
+    SpanHeap* h = NULL;
+    
+    idleLock.lock();
+    if(idleCount > 0) {
+        h = idle[--idleCount];
+    }
+    idleLock.unlock();
+    
+    if(h == NULL) {
+        h = create(__atomic_fetch_add(&nextShard, 1, __ATOMIC_RELAXED) % ChunkShards);
+        if(h == NULL) {
+            ABORT("Couldn't allocate a thread heap");
+        }
+    }
+    
+    pthread_once(&exitKeyOnce, makeExitKey);
+    pthread_setspecific(exitKey, h);
+    
+    current = h;
+    return h;
+}
+
+void* SpanHeap::allocateLarge(size_t sz, size_t align) {
+    // Nothing larger fits in the reserved region, and this keeps the chunk count below from overflowing
+    if(sz > RegionSize) {
+        return NULL;
+    }
+    
+    size_t step = align < CacheLineSize ? CacheLineSize : align;
+    size_t offset;
+    
+    if(step < PAGESIZE) {
+        offset = (_rng.next() % (ChunkSize / PAGESIZE)) * PAGESIZE
+            + (_rng.next() % (PAGESIZE / step)) * step;
+    } else {
+        offset = (_rng.next() % (ChunkSize / step)) * step;
+    }
+    
+    size_t n = (offset + sz + ChunkSize - 1) / ChunkSize;
+    
+    uint8_t* base = (uint8_t*)allocateChunks(n, _shard);
+    if(base == NULL) {
+        return NULL;
+    }
+    
+    // The object owns the rest of its chunks, from the page it starts on
+    uint8_t* p = base + offset;
+    size_t page = offset & ~(size_t)(PAGESIZE - 1);
+    setPages(base + page, n * ChunkSize - page, NULL, n * ChunkSize - offset);
+    
+    return p;
+}
+
+void freeLarge(void* p, size_t size, size_t shard) {
+    uintptr_t base = (uintptr_t)getChunk(p);
+    uintptr_t page = (uintptr_t)p & ~(uintptr_t)(PAGESIZE - 1);
+    uintptr_t limit = (uintptr_t)p + size;
+    
+    clearPages((void*)page, limit - page);
+    freeChunks((void*)base, (limit - base) / ChunkSize, shard);
+}
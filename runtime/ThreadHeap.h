@@ -0,0 +1,408 @@
+#if !defined(RUNTIME_THREADHEAP_H)
+#define RUNTIME_THREADHEAP_H
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ChunkSource.h"
+#include "Heap.h"
+#include "PageMap.h"
+
+class SpanHeap;
+
+/**
+ * The header at the start of every small object chunk.  A chunk holds objects
+ * of one size class for one thread's heap, and only that thread touches its
+ * header.  Objects are aligned to the largest power of two dividing their
+ * size, which may leave a gap after the header.  Frees and size queries find an object's owner and size in the
+ * page map instead.
+ */
+struct Chunk {
+    size_t sizeClass;
+    size_t size;            //< The size of each object
+    void* free;             //< Objects freed back to this chunk
+    uintptr_t bump;         //< The first object never handed out
+    uintptr_t limit;
+    size_t live;            //< Objects handed out and not yet freed back to this chunk
+    bool listed;            //< Set while the chunk is in its owner's list of chunks with room
+    Chunk* prev;
+    Chunk* next;
+};
+
+/**
+ * Objects up to MaxObjectSize come from per-thread heaps.  Each doubling of
+ * the object size is split into 1 << bits evenly spaced size classes, where
+ * bits is at most MaxClassBits: with two bits the classes run 16, 32, 48,
+ * 64, 80, 96, 112, 128, 160, and so on, so no object wastes more than a
+ * fifth of its block.  With no bits they are powers of two, as in a
+ * Kingsley heap.
+ */
+enum {
+    ChunkHeaderSize = 128,
+    CacheLineSize = 64,
+    
+    MinObjectShift = 4,
+    MinObjectSize = 1 << MinObjectShift,
+    MaxObjectShift = 16,
+    MaxObjectSize = 1 << MaxObjectShift,
+    
+    MaxClassBits = 2,
+    SizeClasses = (1 << MaxClassBits) * (MaxObjectShift - MinObjectShift + 1 - MaxClassBits)
+};
+
+/**
+ * \brief Get the smallest size class that holds an object
+ * \arg sz The object size, at most MaxObjectSize
+ * \arg bits The log of the number of size classes per doubling
+ */
+static inline size_t getSizeClass(size_t sz, size_t bits) {
+    size_t steps = (size_t)1 << bits;
+    
+    // The first classes are MinObjectSize apart
+    if(sz <= steps * MinObjectSize) {
+        return sz == 0 ? 0 : (sz - 1) / MinObjectSize;
+    }
+    
+    // Then each doubling is split evenly, by the bits below the leading one
+    size_t x = sz - 1;
+    size_t b = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(x);
+    return steps * (b - MinObjectShift - bits + 1) + ((x >> (b - bits)) & (steps - 1));
+}
+
+/**
+ * \brief Get the object size of a size class
+ * \arg sizeClass The size class
+ * \arg bits The log of the number of size classes per doubling
+ */
+static inline size_t getClassSize(size_t sizeClass, size_t bits) {
+    size_t steps = (size_t)1 << bits;
+    
+    if(sizeClass < steps) {
+        return MinObjectSize * (sizeClass + 1);
+    }
+    
+    size_t base = (steps * MinObjectSize) << ((sizeClass - steps) >> bits);
+    return base + (((sizeClass - steps) & (steps - 1)) + 1) * (base >> bits);
+}
+
+/**
+ * One thread's small objects.  Each size class takes objects from a list of
+ * chunks with room, and a chunk goes back to the chunk source once all of
+ * its objects are freed.  Only the owning thread allocates and frees here;
+ * other threads hand objects back through a lock-free queue, which the owner
+ * drains on its next allocation.  Large objects are only placed here; any
+ * thread frees them straight back to the chunk source.
+ */
+class SpanHeap {
+private:
+    Chunk* _chunks[SizeClasses];    //< Chunks with room in each class, the one in use first
+    void* _remote;                  //< Objects freed by other threads, linked through their first word
+    size_t _shard;
+    RandomNumberGenerator _rng;     //< Places this heap's large objects
+    
+protected:
+    size_t _classBits;              //< The log of the number of size classes per doubling
+    
+    Chunk* newChunk(size_t sizeClass);
+    void unlink(Chunk* k);
+
+public:
+    SpanHeap(size_t shard);
+    
+    /**
+     * \brief Take an object of a size class from this heap's chunks
+     */
+    void* allocate(size_t sizeClass);
+    
+    /**
+     * \brief Return an object to its chunk.  Only called by the owning thread.
+     */
+    void release(void* p);
+    
+    /**
+     * \brief Allocate an object too large for the size classes in chunks of
+     * its own.  It starts at a random page of its first chunk, and a random
+     * cache line of that page, so its page and cache set alignment change
+     * from one allocation to the next.
+     * \arg sz The object size
+     * \arg align The object's alignment, a power of two up to ChunkSize.
+     * Offsets are drawn from its multiples instead of cache lines when it is larger.
+     * \returns The object, or NULL if it is larger than the data heap's region
+     */
+    void* allocateLarge(size_t sz, size_t align = CacheLineSize);
+    
+    /**
+     * \brief Send an object back to this heap from another thread
+     */
+    inline void pushRemote(void* p) {
+        void* head = __atomic_load_n(&_remote, __ATOMIC_RELAXED);
+        do {
+            *(void**)p = head;
+        } while(!__atomic_compare_exchange_n(&_remote, &head, p, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    
+    inline bool hasRemote() {
+        return __atomic_load_n(&_remote, __ATOMIC_RELAXED) != NULL;
+    }
+    
+    /**
+     * \brief Take every object other threads have sent back
+     * \returns A list linked through each object's first word
+     */
+    inline void* takeRemote() {
+        return __atomic_exchange_n(&_remote, NULL, __ATOMIC_ACQUIRE);
+    }
+    
+    inline size_t getShard() {
+        return _shard;
+    }
+};
+
+/**
+ * A thread's heap, with a shuffling front end on each size class.  Only the
+ * classes the configured spacing uses are ever touched.
+ */
+template<int Shuffle>
+class ThreadHeap : public SpanHeap {
+private:
+    /**
+     * The source a size class's shuffle layer takes objects from and evicts them to
+     */
+    class ClassSource {
+    private:
+        SpanHeap* _heap;
+        size_t _sizeClass;
+        size_t _size;
+    
+    public:
+        void setSizeClass(SpanHeap* heap, size_t sizeClass, size_t size) {
+            _heap = heap;
+            _sizeClass = sizeClass;
+            _size = size;
+        }
+        
+        void* malloc(size_t) {
+            return _heap->allocate(_sizeClass);
+        }
+        
+        void free(void* p) {
+            _heap->release(p);
+        }
+        
+        size_t getSize(void*) {
+            return _size;
+        }
+    };
+    
+    ShuffleHeap<Shuffle, ClassSource> _classes[SizeClasses];
+
+public:
+    ThreadHeap(size_t shard) : SpanHeap(shard) {
+        for(size_t i=0; i<SizeClasses; i++) {
+            _classes[i].setSizeClass(this, i, getClassSize(i, _classBits));
+        }
+    }
+    
+    inline void* malloc(size_t sz) {
+        if(hasRemote()) {
+            drain();
+        }
+        
+        size_t c = getSizeClass(sz, _classBits);
+        return _classes[c].malloc(getClassSize(c, _classBits));
+    }
+    
+    /**
+     * \brief Allocate a small object aligned to a power of two, up to
+     * MaxObjectSize.  Objects in a class whose size is a multiple of the
+     * alignment all fall on the boundary, so the object comes from the
+     * smallest such class that holds it, through its shuffle layer.
+     * \returns The object, or NULL if no size class fits
+     */
+    inline void* memalign(size_t align, size_t sz) {
+        if(hasRemote()) {
+            drain();
+        }
+        
+        size_t last = getSizeClass(MaxObjectSize, _classBits);
+        for(size_t c = getSizeClass(sz, _classBits); c <= last; c++) {
+            size_t size = getClassSize(c, _classBits);
+            if(size % align == 0) {
+                return _classes[c].malloc(size);
+            }
+        }
+        
+        return NULL;
+    }
+    
+    /**
+     * \brief Free one of this heap's objects, through its class's shuffle layer
+     * \arg p The object
+     * \arg size The object size recorded in the page map
+     */
+    inline void free(void* p, size_t size) {
+        _classes[getSizeClass(size, _classBits)].free(p);
+    }
+    
+    /**
+     * \brief Free the objects other threads sent back.  They go through the
+     * shuffle layer like local frees, so where they are reused is just as random.
+     */
+    void drain() {
+        void* p = takeRemote();
+        while(p != NULL) {
+            void* next = *(void**)p;
+            free(p, findPage(p)->size);
+            p = next;
+        }
+    }
+};
+
+/**
+ * \brief Get the calling thread's heap, or NULL if it has none yet
+ */
+SpanHeap* getThreadHeap();
+
+/**
+ * \brief Give the calling thread a heap: one left by an exited thread, or a
+ * new one made by the given function
+ * \arg create Makes a new heap for a shard
+ */
+SpanHeap* attachThreadHeap(SpanHeap* (*create)(size_t shard));
+
+/**
+ * \brief Free a large object's chunks
+ * \arg p The object
+ * \arg size The object's usable size, from the page map
+ * \arg shard The calling heap's shard
+ */
+void freeLarge(void* p, size_t size, size_t shard);
+
+/**
+ * The randomized data heap: a heap per thread, reached through the calling
+ * thread's heap pointer.  Objects freed by a thread other than their owner
+ * are queued back to the owner.  Pointers the page map does not know came
+ * from the system allocator, before the heap took over or from code that
+ * was not instrumented, and are handed back to it.
+ */
+template<int Shuffle>
+class ThreadedHeap : public RandomHeap {
+private:
+    static SpanHeap* create(size_t shard) {
+        void* p = mmap(NULL, sizeof(ThreadHeap<Shuffle>), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) {
+            return NULL;
+        }
+        return new(p) ThreadHeap<Shuffle>(shard);
+    }
+    
+    static inline ThreadHeap<Shuffle>* getLocalHeap() {
+        SpanHeap* h = getThreadHeap();
+        if(h == NULL) {
+            h = attachThreadHeap(create);
+        }
+        return (ThreadHeap<Shuffle>*)h;
+    }
+
+public:
+    void* malloc(size_t sz) {
+        ThreadHeap<Shuffle>* h = getLocalHeap();
+        
+        if(sz > MaxObjectSize) {
+            return h->allocateLarge(sz);
+        }
+        return h->malloc(sz);
+    }
+    
+    void free(void* p) {
+        PageInfo* info = findPage(p);
+        if(info == NULL) {
+            ::free(p);
+            return;
+        }
+        
+        ThreadHeap<Shuffle>* h = getLocalHeap();
+        
+        if(info->owner == NULL) {
+            freeLarge(p, info->size, h->getShard());
+        } else if(info->owner == h) {
+            h->free(p, info->size);
+        } else {
+            info->owner->pushRemote(p);
+        }
+    }
+    
+    /**
+     * Small objects come from the size classes and larger ones from the
+     * large object path, so aligned objects are as randomized as the rest.
+     * Alignments beyond a chunk are left to the system allocator.
+     */
+    void* memalign(size_t align, size_t sz) {
+        if(align <= MinObjectSize) {
+            return malloc(sz);
+        }
+        
+        ThreadHeap<Shuffle>* h = getLocalHeap();
+        
+        if(align <= MaxObjectSize && sz <= MaxObjectSize) {
+            return h->memalign(align, sz);
+        }
+        
+        if(align <= ChunkSize) {
+            return h->allocateLarge(sz, align);
+        }
+        
+        return ::memalign(align, sz);
+    }
+    
+    void* calloc(size_t n, size_t sz) {
+        if(sz != 0 && n > (size_t)-1 / sz) {
+            return NULL;
+        }
+        
+        void* p = malloc(n * sz);
+        if(p != NULL) {
+            memset(p, 0, n * sz);
+        }
+        return p;
+    }
+    
+    void* realloc(void* p, size_t sz) {
+        if(p == NULL) {
+            return malloc(sz);
+        }
+        
+        PageInfo* info = findPage(p);
+        if(info == NULL) {
+            return ::realloc(p, sz);
+        }
+        
+        if(sz == 0) {
+            free(p);
+            return NULL;
+        }
+        
+        size_t old = info->size;
+        if(sz <= old) {
+            return p;
+        }
+        
+        void* q = malloc(sz);
+        if(q != NULL) {
+            memcpy(q, p, old);
+            free(p);
+        }
+        return q;
+    }
+    
+    /**
+     * \returns The usable size of an object, or 0 if the heap does not own it
+     */
+    size_t getSize(void* p) {
+        PageInfo* info = findPage(p);
+        return info == NULL ? 0 : info->size;
+    }
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include <dlfcn.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "Debug.h"
+#include "EpochClock.h"
+#include "FunctionLocation.h"
+#include "Context.h"
+#include "Threads.h"
+
+/**
+ * A thread that may be running relocated code
+ */
+struct ThreadRecord {
+    pthread_t thread;
+    void** top;
+    bool used;
+};
+
+typedef int (*pthread_create_t)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+
+SpinLock runtimeLock;
+
+static ThreadRecord threads[MaxThreads];
+
+/// The calling thread's record, or NULL if it is not registered
+static __thread ThreadRecord* self = NULL;
+
+/// Incremented by each stop; a stopped thread waits until resumed matches the stop it saw
+static volatile size_t stopped = 0;
+static volatile size_t resumed = 0;
+static volatile size_t acknowledged = 0;
+
+static void onStop(int sig, siginfo_t* info, void* p);
+
+/**
+ * Find the real pthread_create, behind the interposer below
+ */
+static pthread_create_t getRealPthreadCreate() {
+    static pthread_create_t real = NULL;
+    
+    if(real == NULL) {
+        real = (pthread_create_t)dlsym(RTLD_NEXT, "pthread_create");
+        
+        if(real == NULL) {
+            ABORT("Unable to find pthread_create");
+        }
+    }
+    
+    return real;
+}
+
+/**
+ * Add the calling thread to the registry
+ */
+static void registerThread(void** top) {
+    runtimeLock.lock();
+    
+    for(size_t i=0; i<MaxThreads; i++) {
+        if(!threads[i].used) {
+            threads[i].thread = pthread_self();
+            threads[i].top = top;
+            threads[i].used = true;
+            self = &threads[i];
+            
+            addEpochClockThread();
+            
+            runtimeLock.unlock();
+            return;
+        }
+    }
+    
+    runtimeLock.unlock();
+    ABORT("Too many threads (at most %d are supported)", MaxThreads);
+}
+
+/**
+ * Remove the calling thread from the registry.  A stop that was already
+ * signaled is still delivered while this waits for the lock, so the stopping
+ * thread is never left waiting for an exited thread.
+ */
+static void unregisterThread(void*) {
+    runtimeLock.lock();
+    removeEpochClockThread();
+    self->used = false;
+    self = NULL;
+    runtimeLock.unlock();
+}
+
+void initThreads(void** top) {
+    struct sigaction sa;
+    sa.sa_sigaction = onStop;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigfillset(&sa.sa_mask);
+    sigaction(STOP_SIGNAL, &sa, NULL);
+    
+    getRealPthreadCreate();
+    registerThread(top);
+}
+
+void** getThreadTop() {
+    if(self != NULL) {
+        return self->top;
+    }
+    
+    // Threads created behind the interposer's back have no registered top, so use the stack's end
+    static __thread void** stackTop = NULL;
+    
+    if(stackTop == NULL) {
+        pthread_attr_t attr;
+        void* addr;
+        size_t size;
+        
+        if(pthread_getattr_np(pthread_self(), &attr) != 0) {
+            ABORT("Unable to find the stack of an unregistered thread");
+        }
+        
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        
+        stackTop = (void**)((uintptr_t)addr + size) - 1;
+    }
+    
+    return stackTop;
+}
+
+/**
+ * Redirect return addresses into defunct function locations on the calling
+ * thread's stack, mark every location still referred to, then wait to be
+ * resumed.
+ *
+ * Stopped threads may be anywhere, including in code without frame pointers,
+ * so the frame chain is only followed while it stays on this stack and moves
+ * up it; any reference the walk misses is found by a conservative scan, which
+ * keeps its location alive instead of rewriting it.  The interrupted
+ * registers are saved on this stack, so they are covered too.
+ */
+static void onStop(int sig, siginfo_t* info, void* p) {
+    if(self == NULL) {
+        return;
+    }
+    
+    size_t stop = stopped;
+    
+    Context c(p);
+    FunctionLocation::redirect(c.ip());
+    
+    void** sp = (void**)c.sp();
+    for(Stack s = c.stack(); s.frame() >= sp && s.frame() < self->top && (void**)s.fp() > s.frame(); s++) {
+        FunctionLocation::redirect(s.ret());
+    }
+    
+    FunctionLocation::markRange((void**)__builtin_frame_address(0), self->top + 1);
+    
+    __atomic_add_fetch(&acknowledged, 1, __ATOMIC_RELEASE);
+    
+    while(__atomic_load_n(&resumed, __ATOMIC_ACQUIRE) != stop) {
+        sched_yield();
+    }
+}
+
+void stopTheWorld() {
+    __atomic_store_n(&acknowledged, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stopped, 1, __ATOMIC_RELEASE);
+    
+    size_t expected = 0;
+    for(size_t i=0; i<MaxThreads; i++) {
+        if(threads[i].used && &threads[i] != self && pthread_kill(threads[i].thread, STOP_SIGNAL) == 0) {
+            expected++;
+        }
+    }
+    
+    while(__atomic_load_n(&acknowledged, __ATOMIC_ACQUIRE) < expected) {
+        sched_yield();
+    }
+    
+    if(expected > 0) {
+        DEBUG("Stopped %lu threads", (unsigned long)expected);
+    }
+}
+
+void resumeTheWorld() {
+    __atomic_store_n(&resumed, stopped, __ATOMIC_RELEASE);
+}
+
+int createRuntimeThread(pthread_t* thread, void* (*fn)(void*), void* arg) {
+    return getRealPthreadCreate()(thread, NULL, fn, arg);
+}
+
+/**
+ * The arguments to a program thread, passed through the interposer
+ */
+struct ThreadStart {
+    void* (*fn)(void*);
+    void* arg;
+};
+
+/**
+ * Run a program thread with its stack top registered
+ */
+static void* threadStart(void* p) {
+    ThreadStart start = *(ThreadStart*)p;
+    free(p);
+    
+    registerThread((void**)__builtin_frame_address(0));
+    
+    void* result;
+    pthread_cleanup_push(unregisterThread, NULL);
+    result = start.fn(start.arg);
+    pthread_cleanup_pop(1);
+    
+    return result;
+}
+
+/**
+ * Interpose on pthread_create, so every program thread is registered
+ */
+extern "C" int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*fn)(void*), void* arg) {
+    ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    start->fn = fn;
+    start->arg = arg;
+    
+    int result = getRealPthreadCreate()(thread, attr, threadStart, start);
+    
+    if(result != 0) {
+        free(start);
+    }
+    
+    return result;
+}
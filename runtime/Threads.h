@@ -0,0 +1,78 @@
+#if !defined(RUNTIME_THREADS_H)
+#define RUNTIME_THREADS_H
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "Arch.h"
+
+/// The signal used to stop other threads at an epoch boundary
+#if defined(SIGPWR)
+#	define STOP_SIGNAL SIGPWR
+#else
+#	define STOP_SIGNAL SIGXCPU
+#endif
+
+/**
+ * A lock that can be taken in signal handlers.  A thread must never try to
+ * take it while a handler interrupted that same thread with the lock held,
+ * so handlers that can interrupt runtime code only use trylock.
+ */
+struct SpinLock {
+private:
+    volatile int _held;
+    
+public:
+    SpinLock() : _held(0) {}
+    
+    inline void lock() {
+        while(__atomic_exchange_n(&_held, 1, __ATOMIC_ACQUIRE)) {
+            _AnyX86(__builtin_ia32_pause());
+        }
+    }
+    
+    inline bool trylock() {
+        return !__atomic_exchange_n(&_held, 1, __ATOMIC_ACQUIRE);
+    }
+    
+    inline void unlock() {
+        __atomic_store_n(&_held, 0, __ATOMIC_RELEASE);
+    }
+};
+
+/// The most program threads that can be registered at once
+enum { MaxThreads = 1024 };
+
+/// Serializes relocation, interception, and epoch changes across threads
+extern SpinLock runtimeLock;
+
+/**
+ * \brief Register the main thread and install the stop signal handler
+ * \arg top The outermost frame of the main thread that can hold relocated code
+ */
+void initThreads(void** top);
+
+/**
+ * \brief Get the outermost frame of the calling thread's stack walk.  A
+ * thread that was never registered gets the last word of its stack.
+ */
+void** getThreadTop();
+
+/**
+ * \brief Stop every other registered thread.  Each one marks the function
+ * locations its stack refers to before it stops.  Called with runtimeLock held.
+ */
+void stopTheWorld();
+
+/**
+ * \brief Let the threads stopped by stopTheWorld continue
+ */
+void resumeTheWorld();
+
+/**
+ * \brief Start one of the runtime's own threads.  These never run relocated
+ * code, so they are not registered, stopped, or scanned.
+ */
+int createRuntimeThread(pthread_t* thread, void* (*fn)(void*), void* arg);
+
+#endif
@@ -4,6 +4,7 @@
 #include <signal.h>
 
 #include "Arch.h"
+#include "Jump.h"
 
 struct X86Trap {
     uint8_t trap_opcode;
@@ -29,6 +30,37 @@ struct PPCTrap {
     
 } __attribute__((packed));
 
+/**
+ * A per-function stub for signal-free lazy relocation, in the style of PLT
+ * lazy binding.  The function header jumps here instead of trapping.  The stub
+ * loads the function's runtime record into r11 (a scratch register that is
+ * never used to pass arguments) and jumps to the resolver trampoline, which
+ * calls into the runtime on the program's own stack.  The trampoline may be
+ * in a shared library far from the code heap, so the stub jumps through an
+ * absolute address instead of using a Jump.
+ */
+struct X86_64ResolverStub {
+    volatile uint8_t movabs_r11[2];
+    volatile uint64_t arg;
+    volatile uint8_t jmp_rip[6];
+    volatile uint64_t target;
+    
+    X86_64ResolverStub(void* arg, void* resolver) {
+        movabs_r11[0] = 0x49;
+        movabs_r11[1] = 0xBB;
+        this->arg = (uint64_t)arg;
+        
+        // jmp *0(%rip), reading the target stored right after the instruction
+        jmp_rip[0] = 0xFF;
+        jmp_rip[1] = 0x25;
+        jmp_rip[2] = jmp_rip[3] = jmp_rip[4] = jmp_rip[5] = 0x00;
+        this->target = (uint64_t)resolver;
+    }
+    
+} __attribute__((packed));
+
+extern "C" void stabilizer_resolve_trampoline();
+
 #if IS_X86
 	typedef X86Trap Trap;
 #elif IS_X86_64
@@ -37,4 +69,11 @@ struct PPCTrap {
 	typedef PPCTrap Trap;
 #endif
 
+#if IS_X86_64
+#	define HAS_RESOLVER 1
+	typedef X86_64ResolverStub ResolverStub;
+#else
+#	define HAS_RESOLVER 0
+#endif
+
 #endif
@@ -2,15 +2,21 @@
 #define RUNTIME_UTIL_H
 
 #include <stdint.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <randomnumbergenerator.h>
 
 #include "Arch.h"
+#include "Config.h"
 
 #ifndef PAGESIZE
 #define PAGESIZE 4096
 #endif
 
+#ifndef HUGEPAGESIZE
+#define HUGEPAGESIZE 0x200000
+#endif
+
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
 #endif
@@ -19,6 +25,7 @@
 #define MAP_32BIT 0
 #endif
 
+// The default alignment of relocated code; STABILIZER_CODE_ALIGN overrides it when the program starts
 #if !defined(CODE_ALIGN)
 #define CODE_ALIGN 32
 #endif
@@ -34,23 +41,29 @@ static void flush_icache(void* begin, size_t size) {
     )
 }
 
-static inline uint8_t getRandomByte() {
+/**
+ * Read a cycle counter, for timing the runtime's own work.  Only ratios of
+ * readings are meaningful.
+ */
+static inline uint64_t readCycles() {
+#if IS_X86 || IS_X86_64
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Draw a stack pad size, in bytes: a random multiple of STABILIZER_STACK_PAD_ALIGN
+ * below STABILIZER_STACK_PAD_ALIGN times STABILIZER_STACK_PAD_RANGE
+ */
+static inline uintptr_t getRandomStackPad() {
     static RandomNumberGenerator _rng;
-    static uint8_t _randCount = 0;
-    
-    static union {
-        uint8_t _rands[sizeof(int)];
-        int _bigRand;
-    };
-    
-    if(_randCount == sizeof(int)) {
-        _bigRand = _rng.next();
-        _randCount = sizeof(int);
-    }
     
-    uint8_t r = _rands[_randCount];
-    _randCount++;
-    return r;
+    const Config& c = getConfig();
+    return (_rng.next() % c.stackPadRange) * c.stackPadAlign;
 }
 
 #endif
@@ -1,16 +1,32 @@
-#include <set>
+#include <algorithm>
+#include <map>
 #include <vector>
 #include <cmath>
+#include <new>
 #include <signal.h>
 #include <cstdlib>
+#include <cstring>
+#include <errno.h>
 #include <execinfo.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 
+#include "CallSites.h"
+#include "CodeArena.h"
+#include "Config.h"
+#include "EpochClock.h"
 #include "Function.h"
 #include "FunctionLocation.h"
 #include "Debug.h"
 #include "Heap.h"
+#include "LiveSet.h"
 #include "Context.h"
+#include "PerfCounter.h"
+#include "Threads.h"
 
 using namespace std;
 
@@ -21,22 +37,111 @@ int main(int argc, char** argv);
 void onTrap(int sig, siginfo_t* info, void*);
 void onTimer(int sig, siginfo_t* info, void*);
 void onFault(int sig, siginfo_t* info, void*);
+void onExit();
 
-void setTimer(int msec);
+extern "C" void* stabilizer_resolve(Function* f);
+
+void takeOverCode();
+void relocateAll();
+void randomizeStackPads();
+void startEpoch(Stack s);
+void relocate(Function* f);
+void relocateLive();
+void intercept(Function* f);
+void interceptLive(Context* c);
+void relocateCalled(Function* f);
+void aliasText();
+void checkBounds();
+
+void startPrecopy();
+void requestPrecopy();
+void* precopyThread(void*);
+
+void setTimer(size_t ticks);
+size_t adaptInterval();
 void setHandler(int sig, void(*fn)(int, siginfo_t*, void*));
 
 typedef void(*ctor_t)();
 
-set<Function*> functions;
-set<Function*> live_functions;
-set<uint8_t*> stack_pads;
+/**
+ * One function's entry in a module's static function table.  The compiler
+ * pass emits these in the stabilizer_functions section, with every field
+ * pointer-sized, and registers each module's table with a single call.
+ */
+struct FunctionRecord {
+    void* codeBase;
+    void* codeLimit;
+    void* tableBase;
+    uintptr_t tableSize;
+    uintptr_t callSlots;
+    uintptr_t adjacent;
+    uintptr_t* stackPad;
+};
+
+vector<Function*> functions;
+LiveSet live_functions;
+LiveSet eager_functions;
+vector<uintptr_t*> stack_pads;
+vector<Function*> legacy_pads;
 vector<ctor_t> constructors;
 
 bool rerandomizing = false;
-size_t interval = 500;
+bool moveCode = false;
+bool oneShot = false;
+bool eager = false;
+bool resolver = false;
+bool precopy = false;
+bool directCalls = false;
+bool safepoints = false;
+bool arenas = false;
+bool useHeap = false;
+HugePageMode hugeCode = HugePagesOff;
+size_t interval = 0;
+
+/// Set by the timer when modules poll at safepoints; the next poll starts the epoch
+extern "C" {
+    volatile int32_t stabilizer_epoch_pending = 0;
+}
+
+/// Wakes the pre-copy thread.  A pipe, since it must be written from signal handlers
+int precopyPipe[2];
 
 void** topFrame = NULL;
 
+/// Epoch boundaries so far, and the functions intercepted or moved at them
+size_t epochs = 0;
+size_t touched = 0;
+
+/// Counts iTLB misses over the program's run, if STABILIZER_COUNT_ITLB is set
+PerfCounter* itlbMisses = NULL;
+
+/// Count data cache misses over the program's run, if STABILIZER_COUNT_CACHE is set
+PerfCounter* l1dMisses = NULL;
+PerfCounter* llcMisses = NULL;
+
+/// Cycles spent relocating in traps (and resolver or safepoint calls), in the timer, and sweeping within either
+uint64_t trapCycles = 0;
+uint64_t timerCycles = 0;
+uint64_t sweepCycles = 0;
+uint64_t startCycles = 0;
+
+/// The cycle count and runtime cycles at the start of the current epoch
+uint64_t epochStartCycles = 0;
+uint64_t epochStartSpent = 0;
+
+/// If nonzero, the share of cycles the runtime may spend; the interval adapts to it
+double overheadBudget = 0;
+
+/// Epochs that run at the shortest interval before the budget applies, so short runs still get several layouts
+size_t minEpochs = 10;
+
+/// The range the adaptive interval may move in, in epoch clock ticks
+size_t minInterval = 10;
+size_t maxInterval = 10000;
+
+/// Each epoch's interval is written here, if STABILIZER_INTERVAL_LOG is set
+int intervalLog = -1;
+
 /**
  * Entry point for a program run with Stabilizer.  The program's existing
  * main function has been renamed 'stabilizer_main' by the compiler pass.
@@ -47,6 +152,79 @@ void** topFrame = NULL;
  * 4. Set the re-randomization timer
  * 5. Call module constructors
  * 6. Invoke stabilizer_main
+ *
+ * Options are read from STABILIZER_* environment variables, or from the file
+ * named by STABILIZER_CONFIG (see Config.h), so parameter sweeps need no
+ * rebuild.  Besides the options below, STABILIZER_DATA_SHUFFLE and
+ * STABILIZER_CODE_SHUFFLE size the heaps' shuffle buffers (256 by default,
+ * from a menu of powers of two from 16 to 1024), STABILIZER_HEAP_CLASSES
+ * sets how many data heap size classes split each doubling of object size
+ * (1, for power of two classes, or 2 or 4), STABILIZER_CODE_ALIGN sets the
+ * alignment of relocated code (32 bytes), and STABILIZER_STACK_PAD_ALIGN
+ * and STABILIZER_STACK_PAD_RANGE make each stack pad one of RANGE multiples
+ * of ALIGN bytes (256 multiples of 16).
+ *
+ * If STABILIZER_ONE_SHOT is set, the layout is randomized once: every function
+ * is relocated and every stack pad is set before the program starts, and no
+ * timer is armed.  Calls still go through relocation tables, but never trap.
+ *
+ * STABILIZER_RANDOMIZE lists the randomizations to apply, of "code", "stack"
+ * and "heap" (all of them by default), so one build can be compared against
+ * itself with any of them off.  Without code randomization functions run
+ * from the original text and their relocation tables keep pointing at the
+ * originals; without stack randomization every pad stays 0; without heap
+ * randomization the program's allocations go to the system allocator.
+ *
+ * If STABILIZER_EAGER is set, functions that were live in the previous epoch
+ * are relocated together at the first trap of each epoch. Only functions that
+ * have never been called keep paying for a trap.
+ *
+ * If STABILIZER_RESOLVER is set, function headers jump to a resolver stub
+ * instead of trapping, so lazy relocation runs on the program's stack without
+ * a signal.
+ *
+ * If STABILIZER_PRECOPY is set, a helper thread allocates and copies each
+ * relocated function's next location in the background, so relocation only
+ * has to flip the forwarding jump.
+ *
+ * If STABILIZER_HUGE_CODE is set, the code heap is backed by 2MB pages:
+ * transparent huge pages by default, or the hugetlbfs pool if it is set to
+ * "hugetlb".  Set STABILIZER_COUNT_ITLB to report iTLB misses at exit, for
+ * comparing the two modes.
+ *
+ * If STABILIZER_ARENAS is set, the copies made in each epoch are placed in an
+ * arena of their own, and an arena is released in one call once none of its
+ * copies are current or on a stack.  Trapped functions give up their current
+ * copy at the epoch boundary, so old arenas drain as their frames return.
+ *
+ * STABILIZER_CLOCK picks what ends an epoch: "real" time (the default),
+ * "prof" or "cpu" time, so programs blocked on I/O are not re-randomized
+ * while idle, or "instructions" retired by the main thread, so the number
+ * of epochs in a run does not depend on the machine or its load.
+ * STABILIZER_INTERVAL sets the epoch length, in milliseconds or in millions
+ * of instructions.
+ *
+ * If STABILIZER_OVERHEAD is set to a percentage, the runtime times its own
+ * handlers and stretches or shrinks each epoch so they take about that share
+ * of the program's cycles.  The first STABILIZER_MIN_EPOCHS epochs (10 by
+ * default) use the shortest interval, so short runs still see several
+ * layouts.  STABILIZER_INTERVAL_LOG names a file that receives each epoch's
+ * interval and measured overhead.
+ *
+ * Set STABILIZER_COUNT_CACHE to report level 1 data and last level cache
+ * read misses and peak resident memory at exit, for comparing heap layouts.
+ *
+ * Set STABILIZER_STATS to report how many functions were touched at epoch
+ * boundaries, and the most code heap memory relocated functions held at once.
+ *
+ * Modules built with -stabilize-direct-calls keep their PC-relative calls
+ * instead of calling through the relocation table.  Their call sites are read
+ * from the relocations the linker kept, and patched in every copy.
+ *
+ * Modules built with -stabilize-safepoints poll a flag at function entries and
+ * loop back-edges.  The timer only sets the flag, and the next poll intercepts
+ * the live set and starts the epoch on the program's own stack, instead of at
+ * whatever instruction the timer signal interrupted.
  */
 int main(int argc, char **argv) {
     DEBUG("Initializing Stabilizer");
@@ -54,22 +232,140 @@ int main(int argc, char **argv) {
     topFrame = (void**)__builtin_frame_address(0);
     DEBUG("Stack top is at %p", topFrame);
 
+    // Register the main thread; other threads register themselves as they start
+    initThreads(topFrame);
+
+    const Config& config = getConfig();
+
+    // A program built with code randomization can still run from its original text
+    moveCode = config.randomizeCode && functions.size() > 0;
+    DEBUG("Code randomization is %s", moveCode ? "on" : "off");
+
+    oneShot = getOption("ONE_SHOT") != NULL;
+    DEBUG("Randomizing %s", oneShot ? "once at startup" : "every epoch");
+
+    eager = getOption("EAGER") != NULL;
+    DEBUG("Using %s relocation", eager ? "eager" : "lazy");
+
+    resolver = getOption("RESOLVER") != NULL;
+    if(resolver && !HAS_RESOLVER) {
+        fprintf(stderr, "Stabilizer: resolver stubs are not supported on this target, using traps\n");
+        resolver = false;
+    }
+    DEBUG("Intercepting calls with %s", resolver ? "resolver stubs" : "traps");
+
+    precopy = moveCode && !oneShot && getOption("PRECOPY") != NULL;
+    if(precopy) {
+        startPrecopy();
+        DEBUG("Started pre-copy thread");
+    }
+
+    arenas = getOption("ARENAS") != NULL;
+    if(arenas) {
+        useCodeArenas();
+        DEBUG("Placing relocated code in per-epoch arenas");
+    }
+
+    const char* huge = getOption("HUGE_CODE");
+    if(huge != NULL) {
+        hugeCode = strcmp(huge, "hugetlb") == 0 ? HugePagesMapped : HugePagesAdvise;
+        getCodeRegion()->setHugePages(hugeCode);
+        DEBUG("Backing code with %s huge pages", hugeCode == HugePagesMapped ? "hugetlbfs" : "transparent");
+    }
+
+    EpochClock clock = RealTimeClock;
+    const char* clockName = getOption("CLOCK");
+    if(clockName != NULL && !parseEpochClock(clockName, clock)) {
+        fprintf(stderr, "Stabilizer: unknown clock '%s', using real time\n", clockName);
+    }
+    initEpochClock(clock);
+
+    interval = config.interval;
+    DEBUG("Re-randomizing every %lu ticks of the %s clock", (unsigned long)interval, getEpochClockName());
+
+    const char* overhead = getOption("OVERHEAD");
+    if(overhead != NULL && atof(overhead) > 0) {
+        overheadBudget = atof(overhead) / 100;
+
+        const char* epochCount = getOption("MIN_EPOCHS");
+        if(epochCount != NULL) {
+            minEpochs = atol(epochCount);
+        }
+
+        if(minEpochs > 0) {
+            interval = minInterval;
+        }
+
+        const char* logName = getOption("INTERVAL_LOG");
+        if(logName != NULL) {
+            intervalLog = open(logName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+
+        DEBUG("Adapting the interval to a %.1f%% overhead budget", overheadBudget * 100);
+    }
+
     // Register signal handlers
     setHandler(Trap::TrapSignal, onTrap);
-    setHandler(SIGALRM, onTimer);
+    setHandler(getEpochSignal(), onTimer);
     setHandler(SIGSEGV, onFault);
     DEBUG("Signal handlers installed");
 
-    // Lazily relocate functions
-    for(set<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
-        Function* f = *iter;
-        f->setTrap();
+    checkBounds();
+
+    if(moveCode) {
+        takeOverCode();
+    } else {
+        // Functions run in place, so only the stack pads change between epochs
+        if(functions.size() > 0) {
+            aliasText();
+        }
+        for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+            // Without room for its table after the original, a function runs from one copy instead
+            if(!(*iter)->placeOriginalTable()) {
+                (*iter)->placeHeader();
+                relocate(*iter);
+            }
+
+            if((*iter)->getStackPad() == NULL) {
+                continue;
+            } else if((*iter)->isLegacy()) {
+                legacy_pads.push_back(*iter);
+            } else {
+                stack_pads.push_back((*iter)->getStackPad());
+            }
+        }
     }
-    DEBUG("Trapped all functions");
 
-    // Set the re-randomization timer
-    setTimer(interval);
-    DEBUG("Set re-randomization timer");
+    // Pads that do not move with a function get their first random size here
+    if(config.randomizeStack) {
+        randomizeStackPads();
+    }
+
+    // Set the re-randomization timer, unless no randomization is left to redo
+    startCycles = readCycles();
+    epochStartCycles = startCycles;
+    if(!oneShot && (moveCode || (config.randomizeStack && stack_pads.size() + legacy_pads.size() > 0))) {
+        setTimer(interval);
+        DEBUG("Set re-randomization timer");
+    }
+
+    // Report anything that fell off the fast path when the program exits
+    atexit(onExit);
+
+    if(getOption("COUNT_ITLB") != NULL) {
+        itlbMisses = PerfCounter::iTLBMisses();
+        if(!itlbMisses->isValid()) {
+            fprintf(stderr, "Stabilizer: unable to count iTLB misses on this system\n");
+        }
+    }
+
+    if(getOption("COUNT_CACHE") != NULL) {
+        l1dMisses = PerfCounter::l1dMisses();
+        llcMisses = PerfCounter::llcMisses();
+        if(!l1dMisses->isValid() || !llcMisses->isValid()) {
+            fprintf(stderr, "Stabilizer: unable to count cache misses on this system\n");
+        }
+    }
 
     // Call all constructors
     for(vector<ctor_t>::iterator i = constructors.begin(); i != constructors.end(); i++) {
@@ -84,45 +380,549 @@ int main(int argc, char **argv) {
     return r;
 }
 
+/**
+ * Take over every registered function's entry, so its first call in each
+ * epoch relocates it
+ */
+void takeOverCode() {
+    // Give the original code a writable alias and place each function's header
+    aliasText();
+    for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        (*iter)->moveStackPad();
+        (*iter)->placeHeader();
+    }
+    DEBUG("Placed function headers");
+
+    // Find the callee behind each direct call slot, so calls can skip forwarding jumps
+    map<void*, Function*> bases;
+    for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        bases[(*iter)->getCodeBase()] = *iter;
+    }
+    for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        (*iter)->findCallees(bases);
+    }
+    DEBUG("Resolved direct call targets");
+
+    if(directCalls) {
+        findCallSites(functions);
+        DEBUG("Found call sites for PC-relative calls");
+    }
+
+    // Size the live set and location pool so handlers don't allocate
+    live_functions.reserve(functions.size());
+    if(eager) {
+        eager_functions.reserve(functions.size());
+    }
+    FunctionLocation::reserve(functions.size() * 2);
+
+    if(oneShot) {
+        relocateAll();
+        DEBUG("Relocated all functions");
+    } else {
+        // Lazily relocate functions
+        for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+            intercept(*iter);
+        }
+        DEBUG("Trapped all functions");
+    }
+}
+
+/**
+ * Check that every registered function has room for its header and ends
+ * before the next one starts.  The pass marks each function's end with a
+ * dummy function placed after it, which the linker only keeps there if both
+ * are in the same section.
+ */
+void checkBounds() {
+    vector<pair<uintptr_t, uintptr_t> > bounds;
+    for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        uintptr_t base = (uintptr_t)(*iter)->getCodeBase();
+        bounds.push_back(make_pair(base, base + (*iter)->getCodeSize()));
+    }
+
+    sort(bounds.begin(), bounds.end());
+
+    for(size_t i=0; i<bounds.size(); i++) {
+        if(bounds[i].second < bounds[i].first + sizeof(FunctionHeader)) {
+            ABORT("Function at %p is too small for its header; its end marker is not right after it", (void*)bounds[i].first);
+        }
+
+        if(i + 1 < bounds.size() && bounds[i].second > bounds[i + 1].first) {
+            ABORT("Function at %p ends at %p, past the function at %p; its end marker is not right after it",
+                (void*)bounds[i].first, (void*)bounds[i].second, (void*)bounds[i + 1].first);
+        }
+    }
+}
+
+/**
+ * Give the pages holding every registered function a writable alias, so
+ * headers (or the tables of functions that run in place) can be written
+ * without the text ever being writable and executable.  Functions are packed
+ * together in the text, so their pages are coalesced into as few ranges as
+ * possible.  Without memfd there is no alias, and a range is made writable
+ * and executable instead.
+ */
+void aliasText() {
+    vector<pair<uintptr_t, uintptr_t> > ranges;
+    for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        // Include the space reserved for an adjacent relocation table
+        MemRange code((*iter)->getCodeBase(), (*iter)->getAllocationSize());
+        ranges.push_back(make_pair((uintptr_t)code.pageBase(), (uintptr_t)code.pageLimit()));
+    }
+
+    sort(ranges.begin(), ranges.end());
+
+    size_t aliased = 0;
+    size_t writable = 0;
+    for(size_t i=0; i<ranges.size();) {
+        uintptr_t base = ranges[i].first;
+        uintptr_t limit = ranges[i].second;
+
+        // Absorb every following range that overlaps or touches this one
+        for(i++; i<ranges.size() && ranges[i].first <= limit; i++) {
+            limit = max(limit, ranges[i].second);
+        }
+
+        if(getCodeRegion()->aliasText((void*)base, limit - base)) {
+            aliased++;
+        } else if(mprotect((void*)base, limit - base, PROT_READ | PROT_WRITE | PROT_EXEC)) {
+            perror("Unable make code writable");
+            abort();
+        } else {
+            writable++;
+        }
+    }
+
+    if(writable > 0) {
+        fprintf(stderr, "Stabilizer: unable to alias the program text, %lu ranges stay writable and executable\n", (unsigned long)writable);
+    }
+
+    DEBUG("Aliased %lu text ranges for %lu functions", (unsigned long)aliased, (unsigned long)functions.size());
+}
+
+/**
+ * Report code placements that could not use a 32 bit forwarding jump, and
+ * epoch statistics, iTLB misses, and cache misses if they were requested
+ */
+void onExit() {
+    size_t farJumps = X86_64Jump::farJumps();
+    size_t fallbacks = getCodeRegion()->getFallbacks();
+
+    if(farJumps > 0 || fallbacks > 0) {
+        fprintf(stderr, "Stabilizer: %lu far jumps, %lu code allocations outside the near-text region\n",
+            (unsigned long)farJumps, (unsigned long)fallbacks);
+    }
+
+    if(getOption("STATS") != NULL) {
+        fprintf(stderr, "Stabilizer: %lu epochs, %lu functions touched (%.1f per epoch) of %lu registered\n",
+            (unsigned long)epochs, (unsigned long)touched, epochs > 0 ? (double)touched / epochs : 0.0,
+            (unsigned long)functions.size());
+        fprintf(stderr, "Stabilizer: peak code heap use %lu bytes\n", (unsigned long)FunctionLocation::getPeakSize());
+
+        if(arenas) {
+            fprintf(stderr, "Stabilizer: %lu code arenas released\n", (unsigned long)getReleasedArenas());
+        }
+
+        uint64_t total = readCycles() - startCycles;
+        fprintf(stderr, "Stabilizer: %.2f%% of cycles in traps, %.2f%% in the timer, %.2f%% of them sweeping; last interval %lu\n",
+            100.0 * trapCycles / total, 100.0 * timerCycles / total, 100.0 * sweepCycles / total, (unsigned long)interval);
+    }
+
+    if(itlbMisses != NULL && itlbMisses->isValid()) {
+        const char* pages[] = { "4KB", "transparent huge", "hugetlbfs" };
+        fprintf(stderr, "Stabilizer: %llu iTLB misses with %s code pages\n",
+            (unsigned long long)itlbMisses->read(), pages[hugeCode]);
+    }
+
+    if(l1dMisses != NULL) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        fprintf(stderr, "Stabilizer: %llu L1D misses, %llu LLC misses, %ld KB peak RSS with %lu heap classes per doubling\n",
+            (unsigned long long)l1dMisses->read(), (unsigned long long)llcMisses->read(),
+            (long)usage.ru_maxrss, (unsigned long)getConfig().heapClasses);
+    }
+}
+
 extern "C" {
     void stabilizer_register_function(void* codeBase, void* codeLimit, void* tableBase, size_t tableSize, bool adjacent, uint8_t* stackPad) {
-        Function* f = new Function(codeBase, codeLimit, tableBase, tableSize, adjacent, stackPad);
-        functions.insert(f);
+        // Objects from older passes have no call slots, and a one-byte pad
+        Function* f = new Function(codeBase, codeLimit, tableBase, tableSize, 0, adjacent, (uintptr_t*)stackPad);
+        f->setLegacy();
+        f->setIndex(functions.size());
+        functions.push_back(f);
+    }
+
+    void stabilizer_register_functions(FunctionRecord* records, size_t count) {
+        // Build all of the module's Functions in one contiguous allocation
+        Function* f = (Function*)getDataHeap()->malloc(sizeof(Function) * count);
+        functions.reserve(functions.size() + count);
+
+        for(size_t i=0; i<count; i++) {
+            FunctionRecord& r = records[i];
+            ::new(&f[i]) Function(r.codeBase, r.codeLimit, r.tableBase, r.tableSize, r.callSlots, r.adjacent, r.stackPad);
+            f[i].setIndex(functions.size());
+            functions.push_back(&f[i]);
+        }
     }
 
     void stabilizer_register_constructor(ctor_t ctor) {
         constructors.push_back(ctor);
     }
 
-    void stabilizer_register_stack_pad(uint8_t* pad) {
-        stack_pads.insert(pad);
+    void stabilizer_register_stack_pad(uintptr_t* pad) {
+        stack_pads.push_back(pad);
+    }
+
+    void stabilizer_use_direct_calls() {
+        directCalls = true;
+    }
+
+    void stabilizer_use_safepoints() {
+        safepoints = true;
+    }
+
+    void stabilizer_use_heap() {
+        useHeap = true;
     }
 
+    /**
+     * Called from a compiler-inserted poll when stabilizer_epoch_pending is set.
+     * Every frame on this thread's stack is at a call, so the walk is precise.
+     */
+    void stabilizer_safepoint() {
+        runtimeLock.lock();
+        uint64_t start = readCycles();
+
+        // Another thread may have reached a safepoint first
+        if(stabilizer_epoch_pending) {
+            stabilizer_epoch_pending = 0;
+
+            DEBUG("Re-randomization started at safepoint");
+
+            interceptLive(NULL);
+            startEpoch(Stack(__builtin_frame_address(0)));
+        }
+
+        trapCycles += readCycles() - start;
+        runtimeLock.unlock();
+    }
+
+    // With heap randomization off, the program's allocations go straight to the system allocator
+
     void* stabilizer_malloc(size_t sz) {
+        if(!getConfig().randomizeHeap) {
+            return malloc(sz);
+        }
         return getDataHeap()->malloc(sz);
     }
 
     void* stabilizer_calloc(size_t n, size_t sz) {
+        if(!getConfig().randomizeHeap) {
+            return calloc(n, sz);
+        }
         return getDataHeap()->calloc(n, sz);
     }
 
     void* stabilizer_realloc(void *p, size_t sz) {
+        if(!getConfig().randomizeHeap) {
+            return realloc(p, sz);
+        }
         return getDataHeap()->realloc(p, sz);
     }
 
+    // The data heap hands pointers it does not own back to the system allocator
+
     void stabilizer_free(void *p) {
-        if(getDataHeap()->getSize(p) == 0) {
+        if(!getConfig().randomizeHeap) {
             free(p);
         } else {
             getDataHeap()->free(p);
         }
     }
 
+    // Alignments that are not powers of two are rounded up, as the system memalign does,
+    // and like it any alignment past the largest power of two is rejected
+
+    void* stabilizer_memalign(size_t align, size_t sz) {
+        if(align > ~((size_t)-1 >> 1)) {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        if(!getConfig().randomizeHeap) {
+            return memalign(align, sz);
+        }
+
+        size_t a = 1;
+        while(a < align) {
+            a <<= 1;
+        }
+
+        void* p = getDataHeap()->memalign(a, sz);
+        if(p == NULL) {
+            errno = ENOMEM;
+        }
+        return p;
+    }
+
+    void* stabilizer_aligned_alloc(size_t align, size_t sz) {
+        if(align == 0 || (align & (align - 1)) != 0) {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        return stabilizer_memalign(align, sz);
+    }
+
+    int stabilizer_posix_memalign(void** p, size_t align, size_t sz) {
+        if(align < sizeof(void*) || (align & (align - 1)) != 0) {
+            return EINVAL;
+        }
+
+        void* q = stabilizer_memalign(align, sz);
+        if(q == NULL) {
+            return ENOMEM;
+        }
+
+        *p = q;
+        return 0;
+    }
+
+    size_t stabilizer_malloc_usable_size(void* p) {
+        size_t sz = getConfig().randomizeHeap ? getDataHeap()->getSize(p) : 0;
+        return sz != 0 ? sz : malloc_usable_size(p);
+    }
+
+    char* stabilizer_strdup(const char* s) {
+        size_t n = strlen(s) + 1;
+        char* p = (char*)stabilizer_malloc(n);
+        if(p != NULL) {
+            memcpy(p, s, n);
+        }
+        return p;
+    }
+
+    char* stabilizer_strndup(const char* s, size_t n) {
+        n = strnlen(s, n);
+        char* p = (char*)stabilizer_malloc(n + 1);
+        if(p != NULL) {
+            memcpy(p, s, n);
+            p[n] = '\0';
+        }
+        return p;
+    }
+
+    /**
+     * Allocate for operator new: retry through the new handler until the
+     * allocation succeeds, and throw if there is no handler
+     * \arg randomize If false, allocate from the system allocator
+     */
+    static void* newObject(size_t align, size_t sz, bool randomize = true) {
+        if(sz == 0) {
+            sz = 1;
+        }
+
+        while(true) {
+            void* p;
+            if(randomize) {
+                p = align <= 16 ? stabilizer_malloc(sz) : stabilizer_memalign(align, sz);
+            } else {
+                p = align <= 16 ? malloc(sz) : memalign(align, sz);
+            }
+
+            if(p != NULL) {
+                return p;
+            }
+
+            new_handler handler = get_new_handler();
+            if(handler == NULL) {
+                throw bad_alloc();
+            }
+            handler();
+        }
+    }
+
+    void* stabilizer_new(size_t sz) {
+        return newObject(0, sz);
+    }
+
+    void* stabilizer_new_aligned(size_t sz, size_t align) {
+        return newObject(align, sz);
+    }
+
+    // The nothrow_t arguments are only used to pick the overload, so they are passed as plain pointers
+
+    void* stabilizer_new_nothrow(size_t sz, void*) {
+        try {
+            return newObject(0, sz);
+        } catch(bad_alloc&) {
+            return NULL;
+        }
+    }
+
+    void* stabilizer_new_aligned_nothrow(size_t sz, size_t align, void*) {
+        try {
+            return newObject(align, sz);
+        } catch(bad_alloc&) {
+            return NULL;
+        }
+    }
+
+    // The data heap finds an object's size and alignment from its page, so every delete is a free
+
+    void stabilizer_delete(void* p) {
+        stabilizer_free(p);
+    }
+
+    void stabilizer_delete_sized(void* p, size_t) {
+        stabilizer_free(p);
+    }
+
+    void stabilizer_delete_aligned(void* p, size_t) {
+        stabilizer_free(p);
+    }
+
+    void stabilizer_delete_sized_aligned(void* p, size_t, size_t) {
+        stabilizer_free(p);
+    }
+
+    void stabilizer_delete_nothrow(void* p, void*) {
+        stabilizer_free(p);
+    }
+
+    void stabilizer_delete_aligned_nothrow(void* p, size_t, void*) {
+        stabilizer_free(p);
+    }
+
     void reportDoubleFreeError() {
         ABORT("Double free error");
     }
 }
 
+/*
+ * The global operator new and delete are replaced as well, so modules the pass
+ * did not see (the C++ library, or uninstrumented shared libraries) allocate
+ * from the same heap as instrumented code and can free each other's objects.
+ * They are weak, so a program that replaces them keeps its own.  szc links
+ * the runtime ahead of libstdc++, so these are the definitions it binds to.
+ */
+
+/**
+ * Whether the global operators share the randomized heap: only once a module
+ * built with -Rheap has registered, so -Rcode and -Rstack builds keep the
+ * system allocator.  Objects allocated before then are still freed
+ * correctly, since the data heap hands pointers it does not own back to the
+ * system allocator.
+ */
+static inline bool globalHeap() {
+    return useHeap && getConfig().randomizeHeap;
+}
+
+static inline void* globalNew(size_t align, size_t sz) {
+    return newObject(align, sz, globalHeap());
+}
+
+static inline void* globalNewNothrow(size_t align, size_t sz) {
+    try {
+        return newObject(align, sz, globalHeap());
+    } catch(bad_alloc&) {
+        return NULL;
+    }
+}
+
+static inline void globalDelete(void* p) {
+    if(globalHeap()) {
+        getDataHeap()->free(p);
+    } else {
+        free(p);
+    }
+}
+
+__attribute__((weak)) void* operator new(size_t sz) {
+    return globalNew(0, sz);
+}
+
+__attribute__((weak)) void* operator new[](size_t sz) {
+    return globalNew(0, sz);
+}
+
+__attribute__((weak)) void* operator new(size_t sz, const nothrow_t&) noexcept {
+    return globalNewNothrow(0, sz);
+}
+
+__attribute__((weak)) void* operator new[](size_t sz, const nothrow_t&) noexcept {
+    return globalNewNothrow(0, sz);
+}
+
+__attribute__((weak)) void operator delete(void* p) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete[](void* p) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete(void* p, size_t) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete[](void* p, size_t) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete(void* p, const nothrow_t&) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete[](void* p, const nothrow_t&) noexcept {
+    globalDelete(p);
+}
+
+#if defined(__cpp_aligned_new)
+
+__attribute__((weak)) void* operator new(size_t sz, align_val_t align) {
+    return globalNew((size_t)align, sz);
+}
+
+__attribute__((weak)) void* operator new[](size_t sz, align_val_t align) {
+    return globalNew((size_t)align, sz);
+}
+
+__attribute__((weak)) void* operator new(size_t sz, align_val_t align, const nothrow_t&) noexcept {
+    return globalNewNothrow((size_t)align, sz);
+}
+
+__attribute__((weak)) void* operator new[](size_t sz, align_val_t align, const nothrow_t&) noexcept {
+    return globalNewNothrow((size_t)align, sz);
+}
+
+__attribute__((weak)) void operator delete(void* p, align_val_t) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete[](void* p, align_val_t) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete(void* p, size_t, align_val_t) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete[](void* p, size_t, align_val_t) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete(void* p, align_val_t, const nothrow_t&) noexcept {
+    globalDelete(p);
+}
+
+__attribute__((weak)) void operator delete[](void* p, align_val_t, const nothrow_t&) noexcept {
+    globalDelete(p);
+}
+
+#endif
+
 void onTrap(int sig, siginfo_t* info, void* p) {
     Context c(p);
 
@@ -133,71 +933,374 @@ void onTrap(int sig, siginfo_t* info, void* p) {
     FunctionHeader* h = (FunctionHeader*)c.ip();
     Function* f = h->getFunction();
 
+    // Other threads may trap at the same time; they wait here, but still answer stop requests
+    runtimeLock.lock();
+    uint64_t start = readCycles();
+
     // If the trap was placed to trigger a re-randomization
     if(rerandomizing) {
         DEBUG("Re-randomization started after trap on %p", c.ip());
-        (void) live_functions.empty();
-
-        // Mark all on-stack function locations as used
-        Stack s = c.stack();
-        while(s.fp() != topFrame) {
-            FunctionLocation::mark(s.ret());
-            s++;
-        }
 
         // Mark the current instruction pointer as used
         FunctionLocation::mark((void*)c.ip());
 
-        // Mark the top return address on the stack as used
-        FunctionLocation::mark(*(void**)c.sp());
+        // The trapped call's return address is not on the frame chain yet
+        FunctionLocation::redirect(*(void**)c.sp());
 
-        // Collect unused function locations
-        FunctionLocation::sweep();
+        startEpoch(c.stack());
+    }
 
-        rerandomizing = false;
-        setTimer(interval);
+    relocateCalled(f);
+
+    c.ip() = f->getCurrentLocation()->getBase();
+
+    trapCycles += readCycles() - start;
+    runtimeLock.unlock();
+}
+
+/**
+ * Called by the resolver trampoline on the first call to a function in each
+ * epoch.  Does the same work as onTrap, but on the program's stack.
+ * \arg f The function being called
+ * \returns The address the trampoline should jump to
+ */
+void* stabilizer_resolve(Function* f) {
+    runtimeLock.lock();
+    uint64_t start = readCycles();
+
+    if(rerandomizing) {
+        DEBUG("Re-randomization started after resolving %p", f->getCodeBase());
+
+        // The trampoline's frame holds the caller's return address, so a walk from here covers the whole stack
+        startEpoch(Stack(__builtin_frame_address(0)));
+    }
+
+    relocateCalled(f);
+
+    void* base = f->getCurrentLocation()->getBase();
+
+    trapCycles += readCycles() - start;
+    runtimeLock.unlock();
+
+    return base;
+}
+
+/**
+ * Start a new epoch at a safe point: stop every other thread, point return
+ * addresses into defunct function locations at their functions' current
+ * locations, collect the locations nothing refers to any more, and restart
+ * the re-randomization timer.  Called with runtimeLock held.
+ * \arg s The calling thread's stack to walk, starting from the innermost frame
+ */
+void startEpoch(Stack s) {
+    // Other threads redirect and mark their own stacks as they stop
+    stopTheWorld();
+
+    // The chain is only followed while it moves up the stack, since the top may be the stack's end
+    void** top = getThreadTop();
+    while(s.frame() < top && (void**)s.fp() > s.frame()) {
+        FunctionLocation::redirect(s.ret());
+        s++;
+    }
+
+    // Spilled pointers into a relocated function's table still hold its old location
+    FunctionLocation::markRange((void**)__builtin_frame_address(0), top + 1);
+
+    // Copies made from here on belong to the new epoch
+    nextCodeArena();
+
+    // Collect unused function locations
+    uint64_t sweepStart = readCycles();
+    FunctionLocation::sweep();
+    sweepCycles += readCycles() - sweepStart;
+
+    // This is the epoch's safe point, so move the whole live set now
+    if(eager) {
+        relocateLive();
+    }
+
+    rerandomizing = false;
+    interval = adaptInterval();
+    setTimer(interval);
+
+    resumeTheWorld();
+}
+
+/**
+ * Choose the next epoch's length.  The runtime's share of the cycles in the
+ * ending epoch is its overhead, and scaling the interval by the ratio of that
+ * overhead to the budget brings the next epoch back toward the budget.  The
+ * interval changes by at most a factor of two per epoch.  Called with
+ * runtimeLock held.
+ * \returns The next interval, in epoch clock ticks
+ */
+size_t adaptInterval() {
+    uint64_t now = readCycles();
+    uint64_t spent = trapCycles + timerCycles;
+
+    double elapsed = now - epochStartCycles;
+    double overhead = elapsed > 0 ? (spent - epochStartSpent) / elapsed : 0;
+
+    epochStartCycles = now;
+    epochStartSpent = spent;
+
+    size_t next = interval;
+
+    if(overheadBudget > 0) {
+        if(epochs < minEpochs) {
+            next = minInterval;
+        } else {
+            double scale = max(0.5, min(2.0, overhead / overheadBudget));
+            next = max(minInterval, min(maxInterval, (size_t)(interval * scale)));
+        }
+    }
+
+    if(intervalLog != -1) {
+        char line[80];
+        int n = snprintf(line, sizeof(line), "%lu %lu %.4f\n", (unsigned long)epochs, (unsigned long)next, overhead * 100);
+        (void) write(intervalLog, line, n);
     }
 
-    // Relocate the function
+    return next;
+}
+
+/**
+ * Give a function a new location and release its previous one
+ */
+void relocate(Function* f) {
     FunctionLocation* oldLocation = f->relocate();
-    live_functions.insert(f);
 
     if(oldLocation != NULL) {
         oldLocation->release();
     }
 
-    c.ip() = f->getCurrentLocation()->getBase();
+    // The function's prepared copy has been used up, so make another
+    requestPrecopy();
+}
+
+/**
+ * Relocate a function on its first call in this epoch, unless the eager pass
+ * has already moved it (and no sweep has freed the copy since), and add it to
+ * the live set.  Called with runtimeLock held.
+ * \arg f The function being called
+ */
+void relocateCalled(Function* f) {
+    bool moved = live_functions.contains(f) || (eager && eager_functions.contains(f));
+
+    if(!moved || f->getCurrentLocation() == NULL) {
+        relocate(f);
+    }
+
+    if(!live_functions.contains(f)) {
+        live_functions.insert(f);
+    }
+}
+
+/**
+ * Relocate every function that was live in the previous epoch in one pass.
+ * Relocating a function replaces the trap in its header with a jump to the
+ * new location, so none of these functions will trap again this epoch.  They
+ * are not added to this epoch's live set, so one that is no longer called
+ * drops out of the eager set after it is intercepted again.
+ */
+void relocateLive() {
+    DEBUG("Eagerly relocating %lu live functions", (unsigned long)eager_functions.size());
+
+    for(size_t i=0; i<eager_functions.size(); i++) {
+        relocate(eager_functions[i]);
+    }
+
+    // Callees relocated later in the pass were still behind their headers, so link again
+    for(size_t i=0; i<eager_functions.size(); i++) {
+        eager_functions[i]->linkCalls();
+    }
+
+    touched += eager_functions.size();
+}
+
+/**
+ * Relocate every registered function, for a run with one random layout.
+ * Each header becomes a forwarding jump, and once every function has moved
+ * each call slot points straight at its callee's copy, so calls never enter
+ * the runtime again.
+ */
+void relocateAll() {
+    for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        relocate(*iter);
+    }
+
+    for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        (*iter)->linkCalls();
+    }
+
+    touched += functions.size();
+}
+
+/**
+ * Make the next call to a function enter the runtime, either through a trap or
+ * through the function's resolver stub.
+ */
+void intercept(Function* f) {
+    if(resolver) {
+        f->setResolver();
+    } else {
+        f->setTrap();
+    }
 }
 
 void onTimer(int sig, siginfo_t* info, void* p) {
     Context c(p);
 
-    DEBUG("Re-randomization timer fired at %p", c.ip());
+    // Leave the epoch switch to the program's next safepoint poll
+    if(safepoints && moveCode) {
+        stabilizer_epoch_pending = 1;
+        return;
+    }
 
-    if(functions.size() == 0) {
-        DEBUG("Re-randomizing stack pads");
-        for(set<uint8_t*>::iterator iter = stack_pads.begin(); iter != stack_pads.end(); iter++) {
-            uint8_t* pad = *iter;
-            **iter = getRandomByte();
-        }
+    // The resolver runs with signals enabled, and another thread may be relocating, so try again shortly
+    if(!runtimeLock.trylock()) {
+        setTimer(1);
+        return;
+    }
+
+    // With the instruction clock each thread's counter overflows on its own, so the
+    // epoch may already be ending; intercepting again would lose the eager set
+    if(moveCode && rerandomizing) {
+        runtimeLock.unlock();
+        return;
+    }
+
+    uint64_t start = readCycles();
 
+    DEBUG("Re-randomization timer fired at %p", c.ip());
+
+    if(!moveCode) {
+        randomizeStackPads();
         setTimer(interval);
 
     } else {
-        DEBUG("Placing traps");
-        for(set<Function*>::iterator iter = live_functions.begin(); iter != live_functions.end(); iter++) {
-            Function* f = *iter;
-            if(c.ip() == f->getCodeBase()) {
-                DEBUG("Forwarding from trap at %p", c.ip());
-                c.ip() = f->getCurrentLocation()->getBase();
+        interceptLive(&c);
+    }
+
+    rerandomizing = true;
+
+    timerCycles += readCycles() - start;
+    runtimeLock.unlock();
+}
+
+/**
+ * Give every stack pad a new random size, when code is not being relocated
+ * and the pads are not moved along with their functions
+ */
+void randomizeStackPads() {
+    DEBUG("Re-randomizing stack pads");
+    for(size_t i=0; i<stack_pads.size(); i++) {
+        *stack_pads[i] = getRandomStackPad();
+    }
+
+    // Pads from older passes are a byte, which only their functions know how to fill in
+    for(size_t i=0; i<legacy_pads.size(); i++) {
+        legacy_pads[i]->randomizeStackPad();
+    }
+}
+
+/**
+ * Intercept a function that was live in the ending epoch, so its next call
+ * relocates it.  Called with runtimeLock held.
+ * \arg f The function to intercept
+ * \arg c The interrupted context, moved off any header it is stopped on, or NULL at a safepoint
+ */
+static void interceptFunction(Function* f, Context* c) {
+    FunctionLocation* current = f->getCurrentLocation();
+
+    // A function whose location was swept has no copy to forward to, so it traps again instead
+    if(c != NULL && current != NULL && c->ip() == f->getCodeBase()) {
+        DEBUG("Forwarding from trap at %p", c->ip());
+        c->ip() = current->getBase();
+    }
+    intercept(f);
+
+    // The next call makes a new copy, so the current one only lives on in frames that are still running it
+    if(arenas && !eager && current != NULL) {
+        current->release();
+    }
+}
+
+/**
+ * Intercept every function that was live in the ending epoch, so its next
+ * call relocates it.  With eager relocation, the functions moved at the
+ * start of the epoch are intercepted too, and the set collected this epoch
+ * becomes the one the next epoch moves.  Called with runtimeLock held.
+ * \arg c The interrupted context, moved off any header it is stopped on, or NULL at a safepoint
+ */
+void interceptLive(Context* c) {
+    DEBUG("Placing traps");
+    for(size_t i=0; i<live_functions.size(); i++) {
+        interceptFunction(live_functions[i], c);
+    }
+    touched += live_functions.size();
+
+    if(eager) {
+        for(size_t i=0; i<eager_functions.size(); i++) {
+            if(!live_functions.contains(eager_functions[i])) {
+                interceptFunction(eager_functions[i], c);
+                touched++;
             }
-            f->setTrap();
         }
 
-        live_functions.clear();
+        // The next epoch moves this epoch's live set, and collects its own from scratch
+        eager_functions.swap(live_functions);
     }
 
-    rerandomizing = true;
+    epochs++;
+    live_functions.clear();
+}
+
+/**
+ * Start the pre-copy thread.  It sleeps until a relocation uses up a prepared
+ * copy, then refills every relocated function that does not have one.
+ */
+void startPrecopy() {
+    if(pipe(precopyPipe)) {
+        perror("pipe");
+        abort();
+    }
+
+    // Requests are coalesced, so a full pipe can just drop them
+    fcntl(precopyPipe[1], F_SETFL, O_NONBLOCK);
+
+    pthread_t thread;
+    if(createRuntimeThread(&thread, precopyThread, NULL)) {
+        perror("Unable to start pre-copy thread");
+        abort();
+    }
+}
+
+/**
+ * Wake the pre-copy thread.  Safe to call from a signal handler.
+ */
+void requestPrecopy() {
+    if(precopy) {
+        char c = 0;
+        (void) write(precopyPipe[1], &c, 1);
+    }
+}
+
+void* precopyThread(void*) {
+    // Leave every signal to the program's thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    char buf[64];
+    while(read(precopyPipe[0], buf, sizeof(buf)) > 0) {
+        // No functions are registered after main starts, so this list is not modified concurrently
+        for(vector<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+            (*iter)->prepare();
+        }
+    }
+
+    return NULL;
 }
 
 void onFault(int sig, siginfo_t* info, void* p) {
@@ -205,20 +1308,22 @@ void onFault(int sig, siginfo_t* info, void* p) {
     ABORT("Fault at %p, accessing address %p", c.ip(), info->si_addr);
 }
 
-void setTimer(int msec) {
-    struct itimerval timer;
-
-    timer.it_value.tv_sec = (msec - msec % 1000) / 1000;
-    timer.it_value.tv_usec = 1000 * (msec % 1000);
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = 0;
-
-    setitimer(ITIMER_REAL, &timer, 0);
+/**
+ * End the current epoch after an interval on the epoch clock
+ * \arg ticks Milliseconds, or millions of instructions for the instruction clock
+ */
+void setTimer(size_t ticks) {
+    armEpochClock(ticks);
 }
 
 void setHandler(int sig, void(*fn)(int, siginfo_t*, void*)) {
     struct sigaction sa;
     sa.sa_sigaction = (void(*)(int, siginfo_t*, void*))fn;
     sa.sa_flags = SA_SIGINFO;
+
+    // The timer must not interrupt a handler on its own thread while it holds the runtime lock
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, getEpochSignal());
+
     sigaction(sig, &sa, NULL);
 }
@@ -0,0 +1,137 @@
+/**
+ * Allocation throughput benchmark for the randomized data heap.
+ *
+ * Runs the same malloc/free workload with 1, 2, 4, ... 64 threads and reports
+ * the total rate of heap operations.  Each thread churns a private working
+ * set of mixed-size objects, then hands a batch of objects to its neighbour,
+ * which frees them, so both thread-local and cross-thread frees are measured.
+ * With a scalable heap the rate should grow with the thread count up to the
+ * number of cores, then stay flat.
+ *
+ * Every object is tagged with its owner and slot, and the tag is checked
+ * before the object is freed, so the benchmark exits with a nonzero status
+ * if the heap hands out memory that is still in use, on any thread.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+    MaxThreads = 64,
+    WorkingSet = 1024,  //< Live objects each thread keeps while churning
+    Batch = 256,        //< Objects handed to the neighbouring thread each round
+    Operations = 200000,//< Allocations per thread per round
+    Rounds = 10
+};
+
+static size_t threads;
+static pthread_barrier_t barrier;
+static void* batches[MaxThreads][Batch];
+static size_t failures;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// Mostly small objects, with an occasional larger one
+static size_t nextSize(unsigned long& x) {
+    x = x * 6364136223846793005UL + 1442695040888963407UL;
+    size_t r = x >> 33;
+    
+    if(r % 64 == 0) {
+        return 1024 + r % 16384;
+    }
+    return 8 + r % 256;
+}
+
+/// Every object is at least 8 bytes, enough for its owner and slot
+static inline uint64_t tag(size_t id, size_t slot) {
+    return ((uint64_t)id << 32) | slot;
+}
+
+static inline void* allocate(unsigned long& x, uint64_t t) {
+    void* p = malloc(nextSize(x));
+    *(uint64_t*)p = t;
+    return p;
+}
+
+/// Free an object after checking no other allocation has overwritten its tag
+static inline void release(void* p, uint64_t t) {
+    if(*(uint64_t*)p != t) {
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+    }
+    free(p);
+}
+
+static void* worker(void* arg) {
+    size_t id = (size_t)arg;
+    unsigned long x = id + 1;
+    void* live[WorkingSet];
+    
+    for(size_t i=0; i<WorkingSet; i++) {
+        live[i] = allocate(x, tag(id, i));
+    }
+    
+    for(size_t r=0; r<Rounds; r++) {
+        for(size_t i=0; i<Operations; i++) {
+            size_t slot = (x >> 40) % WorkingSet;
+            release(live[slot], tag(id, slot));
+            live[slot] = allocate(x, tag(id, slot));
+        }
+        
+        // Batch objects are tagged past the working set's slots
+        for(size_t i=0; i<Batch; i++) {
+            batches[id][i] = allocate(x, tag(id, WorkingSet + i));
+        }
+        
+        pthread_barrier_wait(&barrier);
+        
+        // Free the objects the previous thread allocated
+        size_t from = (id + threads - 1) % threads;
+        for(size_t i=0; i<Batch; i++) {
+            release(batches[from][i], tag(from, WorkingSet + i));
+        }
+        
+        pthread_barrier_wait(&barrier);
+    }
+    
+    for(size_t i=0; i<WorkingSet; i++) {
+        release(live[i], tag(id, i));
+    }
+    
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    for(threads=1; threads<=MaxThreads; threads*=2) {
+        pthread_t t[MaxThreads];
+        pthread_barrier_init(&barrier, NULL, threads);
+        
+        double start = now();
+        for(size_t i=0; i<threads; i++) {
+            pthread_create(&t[i], NULL, worker, (void*)i);
+        }
+        for(size_t i=0; i<threads; i++) {
+            pthread_join(t[i], NULL);
+        }
+        double elapsed = now() - start;
+        
+        pthread_barrier_destroy(&barrier);
+        
+        double ops = 2.0 * threads * Rounds * (Operations + Batch);
+        printf("%2lu threads %8.2f Mops/s\n", (unsigned long)threads, ops / elapsed * 1e3);
+    }
+    
+    if(failures > 0) {
+        fprintf(stderr, "%lu objects were overwritten while still allocated\n", (unsigned long)failures);
+        return 1;
+    }
+    
+    return 0;
+}
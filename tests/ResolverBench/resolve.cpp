@@ -0,0 +1,120 @@
+/**
+ * Microbenchmark for the cost of the first call to a function in an epoch.
+ *
+ * Registers one small function with the runtime, then repeatedly intercepts
+ * it the way the re-randomization timer does and times the next call, which
+ * relocates the function through a trap or through the resolver trampoline.
+ * The Makefile runs this twice, with and without STABILIZER_RESOLVER, and the
+ * interval is long enough that the timer never fires during a run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "Function.h"
+#include "FunctionLocation.h"
+#include "Threads.h"
+
+enum {
+    Rounds = 10000
+};
+
+/// The registration record the pass emits for each function
+struct FunctionRecord {
+    void* codeBase;
+    void* codeLimit;
+    void* tableBase;
+    uintptr_t tableSize;
+    uintptr_t callSlots;
+    uintptr_t adjacent;
+    uintptr_t* stackPad;
+};
+
+extern "C" void stabilizer_register_functions(FunctionRecord* records, size_t count);
+
+struct Context;
+
+extern bool resolver;
+void interceptLive(Context* c);
+
+/// A leaf function with room for a header, defined in assembly so its bounds are known
+extern "C" unsigned long bench_target(unsigned long);
+extern "C" char bench_target_end[];
+
+asm(
+    ".text\n"
+    ".p2align 6\n"
+    ".globl bench_target\n"
+    ".hidden bench_target\n"
+    "bench_target:\n"
+    "    lea 1(%rdi), %rax\n"
+    "    ret\n"
+    ".p2align 6, 0xcc\n"
+    ".globl bench_target_end\n"
+    ".hidden bench_target_end\n"
+    "bench_target_end:\n"
+);
+
+static FunctionRecord record = {
+    (void*)bench_target, (void*)bench_target_end, NULL, 0, 0, 0, NULL
+};
+
+__attribute__((constructor)) static void registerTarget() {
+    stabilizer_register_functions(&record, 1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+extern "C" int stabilizer_main(int argc, char** argv) {
+    // Call through a volatile pointer, so every call enters the function's header
+    unsigned long (*volatile target)(unsigned long) = bench_target;
+    
+    double* first = new double[Rounds];
+    double* steady = new double[Rounds];
+    unsigned long x = 0;
+    
+    x = target(x);
+    
+    for(size_t i=0; i<Rounds; i++) {
+        runtimeLock.lock();
+        interceptLive(NULL);
+        
+        // Free the copies left behind, as the sweep at each epoch boundary would
+        FunctionLocation::sweep();
+        runtimeLock.unlock();
+        
+        double start = now();
+        x = target(x);
+        double called = now();
+        x = target(x);
+        double again = now();
+        
+        first[i] = called - start;
+        steady[i] = again - called;
+    }
+    
+    if(x != 2 * Rounds + 1) {
+        fprintf(stderr, "bench_target returned %lu, expected %lu\n", x, (unsigned long)(2 * Rounds + 1));
+        return 1;
+    }
+    
+    std::sort(first, first + Rounds);
+    std::sort(steady, steady + Rounds);
+    
+    fprintf(stderr, "%10s %14s %14s %14s\n", "", "first call ns", "first call ns", "steady ns");
+    fprintf(stderr, "%10s %14s %14s %14s\n", "entry", "median", "min", "median");
+    fprintf(stderr, "%10s %14.0f %14.0f %14.0f\n", resolver ? "resolver" : "trap",
+        first[Rounds / 2], first[0], steady[Rounds / 2]);
+    
+    delete[] first;
+    delete[] steady;
+    
+    return 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * Microbenchmark for the steady-state cost of safepoint polls.
+ *
+ * Runs loop- and call-heavy kernels and reports the time per iteration.  The
+ * Makefile builds this file twice, with and without -Rsafepoint, so the
+ * difference between the two runs is the cost of the polls inserted at every
+ * function entry and loop back-edge.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+    Iterations = 100000000,
+    Rounds = 5
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// A tight loop with no calls: one poll per back-edge
+unsigned long loop(unsigned long n) {
+    unsigned long x = 1;
+    for(unsigned long i=0; i<n; i++) {
+        x = x * 6364136223846793005UL + i;
+    }
+    return x;
+}
+
+/// A small function called from a loop: one poll per entry and per back-edge
+unsigned long step(unsigned long x, unsigned long i) {
+    return (x ^ (x >> 7)) + i;
+}
+
+unsigned long calls(unsigned long n) {
+    unsigned long x = 1;
+    for(unsigned long i=0; i<n; i++) {
+        x = step(x, i);
+    }
+    return x;
+}
+
+static void run(const char* name, unsigned long (*kernel)(unsigned long)) {
+    double best = 0;
+    unsigned long result = 0;
+    
+    for(size_t r=0; r<Rounds; r++) {
+        double start = now();
+        result += kernel(Iterations);
+        double elapsed = now() - start;
+        
+        if(r == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    
+    printf("%-8s %6.3f ns/iteration (%lx)\n", name, best / Iterations, result);
+}
+
+int main(int argc, char** argv) {
+    run("loop", loop);
+    run("calls", calls);
+    return 0;
+}
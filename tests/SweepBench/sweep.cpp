@@ -0,0 +1,301 @@
+/**
+ * Microbenchmark for the mark/sweep phase of re-randomization.
+ *
+ * Registers a growing number of synthetic functions with the runtime, gives
+ * each one a current and a defunct location, then times the work onTrap does
+ * at every epoch boundary: marking a stack's worth of return addresses and
+ * sweeping the location registry.
+ *
+ * Also compares the live function set against the std::set it replaced:
+ * the membership test and insert on each function's first trap, and the
+ * scan and clear at each epoch boundary.
+ *
+ * Both parts check the results as well, and the benchmark exits with a
+ * nonzero status if a sweep frees the wrong locations, a lookup maps an
+ * address to the wrong function, or the live set's membership is wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <set>
+
+#include "Function.h"
+#include "FunctionLocation.h"
+#include "LiveSet.h"
+
+enum {
+    FunctionSize = 64,
+    StackDepth = 256,
+    Rounds = 100,
+    LiveShare = 8       //< One registered function in this many is live in each epoch
+};
+
+/// The number of failed checks
+static size_t failures = 0;
+
+/**
+ * Count a failed check, reporting the first few
+ */
+static void expect(bool ok, const char* what) {
+    if(!ok && failures++ < 10) {
+        fprintf(stderr, "FAILED: %s\n", what);
+    }
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(size_t n) {
+    uint8_t* code = (uint8_t*)mmap(NULL, n * FunctionSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED) {
+        perror("mmap");
+        abort();
+    }
+    
+    // Every synthetic function body is just a return
+    memset(code, 0xC3, n * FunctionSize);
+    
+    Function** functions = new Function*[n];
+    void** stack = new void*[StackDepth];
+    void** original = new void*[StackDepth];
+    
+    for(size_t i=0; i<n; i++) {
+        functions[i] = new Function(&code[i * FunctionSize], &code[(i + 1) * FunctionSize], NULL, 0, 0, false, NULL);
+        functions[i]->placeHeader();
+        functions[i]->relocate();
+    }
+    
+    double mark_ns = 0;
+    double sweep_ns = 0;
+    size_t locations = 0;
+    
+    for(size_t round=0; round<Rounds; round++) {
+        // One function's copy from the last epoch stays in use, so the sweep has to keep it
+        Function* held = functions[round % n];
+        void* heldAddress = (uint8_t*)held->getCurrentLocation()->getBase() + 1;
+        
+        // Start a new epoch: every function gets a fresh copy, so the registry holds about 2n locations
+        for(size_t i=0; i<n; i++) {
+            FunctionLocation* old = functions[i]->relocate();
+            if(old != NULL) {
+                old->release();
+            }
+        }
+        
+        // Build a stack of return addresses into random current copies
+        for(size_t i=0; i<StackDepth; i++) {
+            Function* f = functions[rand() % n];
+            size_t offset = rand() % FunctionSize;
+            stack[i] = (uint8_t*)f->getCurrentLocation()->getBase() + offset;
+            original[i] = (uint8_t*)f->getCodeBase() + offset;
+        }
+        
+        locations += FunctionLocation::count();
+        FunctionLocation::mark(heldAddress);
+        
+        double start = now();
+        for(size_t i=0; i<StackDepth; i++) {
+            FunctionLocation::mark(stack[i]);
+        }
+        double marked = now();
+        FunctionLocation::sweep();
+        double swept = now();
+        
+        mark_ns += marked - start;
+        sweep_ns += swept - marked;
+        
+        // Only the current copies and the held one survive, and each still maps back to its original
+        expect(FunctionLocation::count() == n + 1, "sweep kept an unmarked location or freed a marked one");
+        expect(FunctionLocation::adjust(heldAddress) == (uint8_t*)held->getCodeBase() + 1, "marked defunct location not found after sweep");
+        
+        for(size_t i=0; i<StackDepth; i++) {
+            expect(FunctionLocation::adjust(stack[i]) == original[i], "address in a copy mapped to the wrong function");
+        }
+    }
+    
+    fprintf(stderr, "%10lu %14.1f %14.1f\n", (unsigned long)(locations / Rounds),
+        mark_ns / (Rounds * StackDepth), sweep_ns / (Rounds * 1000.0));
+    
+    // Release every location so the next run starts from an empty registry
+    for(size_t i=0; i<n; i++) {
+        delete functions[i];
+    }
+    FunctionLocation::sweep();
+    munmap(code, n * FunctionSize);
+    
+    delete[] original;
+    delete[] stack;
+    delete[] functions;
+}
+
+/**
+ * Run the live set's work for Rounds epochs
+ * \arg live The live set to time
+ * \arg order The functions that trap in each epoch, count per epoch
+ * \arg trap_ns Accumulates the time spent in traps
+ * \arg boundary_ns Accumulates the time spent at epoch boundaries
+ */
+static void runEpochs(LiveSet& live, Function** order, size_t count, double& trap_ns, double& boundary_ns) {
+    size_t touched = 0;
+    
+    for(size_t round=0; round<Rounds; round++) {
+        Function** epoch = &order[round * count];
+        
+        double start = now();
+        for(size_t i=0; i<count; i++) {
+            if(!live.contains(epoch[i])) {
+                live.insert(epoch[i]);
+            }
+        }
+        double trapped = now();
+        for(size_t i=0; i<live.size(); i++) {
+            touched += live[i]->getIndex();
+        }
+        live.clear();
+        double cleared = now();
+        
+        trap_ns += trapped - start;
+        boundary_ns += cleared - trapped;
+    }
+    
+    // Keep the scan from being optimized away
+    if(touched == 1) {
+        fprintf(stderr, " ");
+    }
+}
+
+/**
+ * The same work, with the std::set the runtime used before LiveSet
+ */
+static void runEpochs(std::set<Function*>& live, Function** order, size_t count, double& trap_ns, double& boundary_ns) {
+    size_t touched = 0;
+    
+    for(size_t round=0; round<Rounds; round++) {
+        Function** epoch = &order[round * count];
+        
+        double start = now();
+        for(size_t i=0; i<count; i++) {
+            if(live.find(epoch[i]) == live.end()) {
+                live.insert(epoch[i]);
+            }
+        }
+        double trapped = now();
+        for(std::set<Function*>::iterator iter = live.begin(); iter != live.end(); iter++) {
+            touched += (*iter)->getIndex();
+        }
+        live.clear();
+        double cleared = now();
+        
+        trap_ns += trapped - start;
+        boundary_ns += cleared - trapped;
+    }
+    
+    // Keep the scan from being optimized away
+    if(touched == 1) {
+        fprintf(stderr, " ");
+    }
+}
+
+/**
+ * Check the live set's membership against std::set over the same epochs
+ * \arg order The functions that trap in each epoch, count per epoch
+ * \arg n The number of registered functions
+ */
+static void checkLiveSet(Function** order, size_t count, size_t n) {
+    LiveSet flat;
+    flat.reserve(n);
+    std::set<Function*> tree;
+    
+    for(size_t round=0; round<Rounds; round++) {
+        Function** epoch = &order[round * count];
+        
+        for(size_t i=0; i<count; i++) {
+            if(!flat.contains(epoch[i])) {
+                flat.insert(epoch[i]);
+            }
+            tree.insert(epoch[i]);
+        }
+        
+        expect(flat.size() == tree.size(), "live set size differs from std::set");
+        for(size_t i=0; i<count; i++) {
+            expect(flat.contains(epoch[i]), "live set lost a member");
+        }
+        for(size_t i=0; i<flat.size(); i++) {
+            expect(tree.count(flat[i]) == 1, "live set holds a function that was never inserted");
+        }
+        
+        flat.clear();
+        tree.clear();
+        
+        for(size_t i=0; i<count; i++) {
+            expect(!flat.contains(epoch[i]), "live set kept a member after clear");
+        }
+    }
+}
+
+static void runLiveSet(size_t n) {
+    uint8_t* code = new uint8_t[n * FunctionSize];
+    memset(code, 0xC3, n * FunctionSize);
+    
+    Function** functions = new Function*[n];
+    for(size_t i=0; i<n; i++) {
+        functions[i] = new Function(&code[i * FunctionSize], &code[(i + 1) * FunctionSize], NULL, 0, 0, false, NULL);
+        functions[i]->setIndex(i);
+    }
+    
+    // Both sets see the same traps, drawn at random from every function
+    size_t count = n / LiveShare;
+    Function** order = new Function*[Rounds * count];
+    for(size_t i=0; i<Rounds * count; i++) {
+        order[i] = functions[rand() % n];
+    }
+    
+    LiveSet flat;
+    flat.reserve(n);
+    std::set<Function*> tree;
+    
+    double flat_trap = 0, flat_boundary = 0;
+    double tree_trap = 0, tree_boundary = 0;
+    
+    runEpochs(flat, order, count, flat_trap, flat_boundary);
+    runEpochs(tree, order, count, tree_trap, tree_boundary);
+    checkLiveSet(order, count, n);
+    
+    fprintf(stderr, "%10lu %12.1f %12.1f %14.2f %14.2f\n", (unsigned long)n,
+        flat_trap / (Rounds * count), tree_trap / (Rounds * count),
+        flat_boundary / (Rounds * 1000.0), tree_boundary / (Rounds * 1000.0));
+    
+    for(size_t i=0; i<n; i++) {
+        delete functions[i];
+    }
+    delete[] order;
+    delete[] functions;
+    delete[] code;
+}
+
+extern "C" int stabilizer_main(int argc, char** argv) {
+    fprintf(stderr, "%10s %14s %14s\n", "locations", "mark ns/frame", "sweep us");
+    
+    for(size_t n = 64; n <= 16384; n *= 4) {
+        run(n);
+    }
+    
+    fprintf(stderr, "\n%10s %12s %12s %14s %14s\n", "functions", "LiveSet ns", "std::set ns", "LiveSet us", "std::set us");
+    fprintf(stderr, "%10s %12s %12s %14s %14s\n", "", "per trap", "per trap", "per boundary", "per boundary");
+    
+    for(size_t n = 64; n <= 65536; n *= 4) {
+        runLiveSet(n);
+    }
+    
+    if(failures > 0) {
+        fprintf(stderr, "\n%lu checks failed\n", (unsigned long)failures);
+        return 1;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,118 @@
+/**
+ * Functional test for multithreaded programs.
+ *
+ * Worker threads run recursive calls, calls through function pointers, heap
+ * churn with malloc and new, and floating point work for long enough to span
+ * many epochs, in two waves so threads are created and exit while code is
+ * being re-randomized.  The output does not depend on the layout, so the
+ * Makefile runs this under each runtime mode and compares the output with
+ * threads.expected.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    Threads = 4,
+    Waves = 2,
+    Iterations = 400
+};
+
+struct Node {
+    Node* next;
+    unsigned long value;
+};
+
+static unsigned long results[Waves][Threads];
+static double sums[Waves][Threads];
+
+unsigned long fib(unsigned long n) {
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+unsigned long twice(unsigned long x) {
+    return x * 2;
+}
+
+unsigned long square(unsigned long x) {
+    return x * x;
+}
+
+unsigned long (*ops[])(unsigned long) = { twice, square, fib };
+
+/// Build and free a list, so objects are allocated and freed in different orders
+unsigned long churn(unsigned long n) {
+    Node* head = NULL;
+    for(unsigned long i=0; i<n; i++) {
+        Node* node = new Node;
+        node->next = head;
+        node->value = i;
+        head = node;
+    }
+    
+    unsigned long sum = 0;
+    while(head != NULL) {
+        Node* next = head->next;
+        sum += head->value;
+        delete head;
+        head = next;
+    }
+    return sum;
+}
+
+/// Format a string on the heap and return its length
+unsigned long format(unsigned long id, unsigned long i) {
+    char* s = (char*)malloc(64);
+    snprintf(s, 64, "thread %lu iteration %lu", id, i);
+    unsigned long n = strlen(s);
+    free(s);
+    return n;
+}
+
+double scale(double x, unsigned long i) {
+    return x * 0.5 + (double)i;
+}
+
+void* worker(void* arg) {
+    unsigned long id = (unsigned long)arg;
+    unsigned long wave = id / Threads;
+    unsigned long slot = id % Threads;
+    
+    unsigned long total = 0;
+    double x = 1.0;
+    
+    for(unsigned long i=0; i<Iterations; i++) {
+        total += fib(16 + id);
+        total += ops[i % 3](i % 20);
+        total += churn(64 + slot);
+        total += format(id, i);
+        x = scale(x, i);
+    }
+    
+    results[wave][slot] = total;
+    sums[wave][slot] = x;
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    for(unsigned long wave=0; wave<Waves; wave++) {
+        pthread_t t[Threads];
+        for(unsigned long i=0; i<Threads; i++) {
+            pthread_create(&t[i], NULL, worker, (void*)(wave * Threads + i));
+        }
+        for(unsigned long i=0; i<Threads; i++) {
+            pthread_join(t[i], NULL);
+        }
+    }
+    
+    for(unsigned long wave=0; wave<Waves; wave++) {
+        for(unsigned long i=0; i<Threads; i++) {
+            printf("wave %lu thread %lu: %lu %.3f\n", wave, i, results[wave][i], sums[wave][i]);
+        }
+    }
+    
+    printf("Hello Threads!\n");
+    return 0;
+}